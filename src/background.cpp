@@ -0,0 +1,37 @@
+#include <cstring>
+#include "background.h"
+
+namespace gb {
+
+BackgroundPlane::BackgroundPlane() : pixels(new u8[256 * stride]()) {
+
+}
+
+void BackgroundPlane::update(const u8 *map, u8 row, u8 first, u8 count, const TileCache& tiles, bool signed_tiles) {
+    for(u8 i = 0; i < count; i++) {
+        u8 column = (first + i) % 32;
+        u8 entry = map[row * 32 + column];
+        u16 index = signed_tiles && entry <= 127 ? entry + 256 : entry;
+
+        Cell& cell = cells[row * 32 + column];
+        if(cell.index != index || cell.version != tiles.version(index)) {
+            draw_cell(row, column, index, tiles);
+            cell.index = index;
+            cell.version = tiles.version(index);
+        }
+    }
+}
+
+void BackgroundPlane::draw_cell(u8 row, u8 column, u16 index, const TileCache& tiles) {
+    bool mirrored = column * 8 < visible_width;
+
+    for(u8 y = 0; y < 8; y++) {
+        u8 *line = &pixels[(row * 8 + y) * stride];
+        std::memcpy(line + column * 8, tiles.row(index, y), 8);
+        if(mirrored) {
+            std::memcpy(line + 256 + column * 8, tiles.row(index, y), 8);
+        }
+    }
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include "types.h"
+#include "tiles.h"
+
+namespace gb {
+
+// One 32x32 tile map drawn out to 256x256 colour indexes. Each cell
+// remembers the tile and tile version it was drawn from, so only the
+// cells whose map entry or tile data changed since are drawn again.
+class BackgroundPlane {
+public:
+    // Rows are followed by a copy of their first visible_width pixels, so
+    // any scrolled line is contiguous
+    static constexpr std::size_t visible_width = 160;
+    static constexpr std::size_t stride = 256 + visible_width;
+
+    BackgroundPlane();
+
+    // Brings count cells of row (0-31) up to date, starting at column
+    // first and wrapping around. With signed_tiles map entries 0-127 use
+    // tiles 256-383 (LCDC bit 4 clear)
+    void update(const u8 *map, u8 row, u8 first, u8 count, const TileCache& tiles, bool signed_tiles);
+
+    // Line y (0-255), valid for visible_width pixels past any x
+    const u8 *line(u8 y) const {
+        return &pixels[y * stride];
+    }
+
+private:
+    struct Cell {
+        u16 index = TileCache::count; // Nothing drawn yet
+        std::uint32_t version = 0;
+    };
+
+    void draw_cell(u8 row, u8 column, u16 index, const TileCache& tiles);
+
+    std::array<Cell, 32 * 32> cells;
+    std::unique_ptr<u8[]> pixels;
+};
+
+}
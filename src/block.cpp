@@ -0,0 +1,221 @@
+#include "cpu.h"
+#include "opcodes.h"
+
+namespace gb {
+
+namespace {
+
+// Longest run decoded into one block
+constexpr std::size_t max_block_ops = 64;
+
+// Instruction length in bytes, 0 for opcodes that don't exist
+constexpr u8 op_length(u8 op) {
+    switch(op) {
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+        case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+            return 0;
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x08:
+        case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+        case 0xD2: case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+            return 3;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0xE0: case 0xF0: case 0xE8: case 0xF8: case 0xCB:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Instructions that change pc, a block never continues past one
+constexpr bool ends_block(u8 op) {
+    switch(op) {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7: case 0xC8: case 0xC9:
+        case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+        case 0xD0: case 0xD2: case 0xD4: case 0xD7: case 0xD8: case 0xD9: case 0xDA:
+        case 0xDC: case 0xDF:
+        case 0xE7: case 0xE9: case 0xEF: case 0xF7: case 0xFF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// HALT, STOP and EI look at what follows them, they're always interpreted
+constexpr bool interpret_only(u8 op) {
+    return op == 0x10 || op == 0x76 || op == 0xFB || op_length(op) == 0;
+}
+
+// Machine cycles with no branch taken, CB ops are counted separately
+constexpr std::array<u8, 256> op_cycles = {
+    1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1,
+    1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 0, 3, 6, 2, 4,
+    2, 3, 3, 0, 3, 4, 2, 4, 2, 4, 3, 0, 3, 0, 2, 4,
+    3, 3, 2, 0, 0, 4, 2, 4, 4, 1, 4, 0, 0, 0, 2, 4,
+    3, 3, 2, 1, 0, 4, 2, 4, 3, 2, 4, 1, 0, 0, 2, 4
+};
+
+constexpr u8 cb_cycles(u8 op) {
+    if((op & 7) != 6) {
+        return 2;
+    }
+    // BIT n, (HL) doesn't write back
+    return (op & 0xC0) == 0x40 ? 3 : 4;
+}
+
+}
+
+// Same bodies as the interpreter, but the operands come from the micro-op
+// and their fetch cycles have already been counted by run_block
+#define fetch8() u8(uop.imm)
+#define fetch16() uop.imm
+#define GB_DEFINE_BLOCK_OP(opcode, ...) \
+    template<> void CPU::block_op<0x##opcode>([[maybe_unused]] const MicroOp& uop) { __VA_ARGS__ }
+GB_OPCODES(GB_DEFINE_BLOCK_OP)
+#undef GB_DEFINE_BLOCK_OP
+#undef fetch16
+#undef fetch8
+
+#define GB_BLOCK_HANDLER(opcode, ...) &CPU::block_op<0x##opcode>,
+const std::array<CPU::BlockHandler, 256> CPU::block_table = { GB_OPCODES(GB_BLOCK_HANDLER) };
+#undef GB_BLOCK_HANDLER
+
+void CPU::block_cb(const MicroOp& uop) {
+    (this->*cb_table[uop.imm])();
+}
+
+CPU::Block *CPU::find_block(u16 addr) {
+    const u8 *src = mmu.read_page(addr);
+    if(!src) {
+        // IO/HRAM, always interpreted
+        return nullptr;
+    }
+
+    u8 index = addr >> 8;
+    if(mapped_srcs[index] != src) {
+        std::unique_ptr<BlockPage>& page = block_pages[src];
+        if(!page) {
+            page = std::make_unique<BlockPage>();
+            page->version = mmu.code_version(addr);
+            if(addr >= 0x8000) {
+                mmu.trap_writes(index);
+            }
+        }
+        mapped_pages[index] = page.get();
+        mapped_srcs[index] = src;
+    }
+
+    BlockPage& page = *mapped_pages[index];
+    if(page.version != mmu.code_version(addr)) {
+        // Something in the page was written, decode it all again
+        for(std::unique_ptr<Block>& block : page.blocks) {
+            block.reset();
+        }
+        page.version = mmu.code_version(addr);
+    }
+
+    std::unique_ptr<Block>& block = page.blocks[addr & 0xFF];
+    if(!block) {
+        block = std::make_unique<Block>();
+        decode_block(*block, src, addr);
+    }
+    return block.get();
+}
+
+void CPU::decode_block(Block& block, const u8 *page, u16 addr) {
+    std::size_t offset = addr & 0xFF;
+
+    while(block.ops.size() < max_block_ops) {
+        u8 op = page[offset];
+        u8 length = op_length(op);
+        // Operands on the next page might be mapped from somewhere else
+        if(interpret_only(op) || offset + length > 0x100) {
+            break;
+        }
+
+        MicroOp uop{};
+        uop.length = length;
+        uop.cycles = length * 4;
+        if(length > 1) {
+            uop.imm = page[offset + 1];
+        }
+        if(length > 2) {
+            uop.imm |= page[offset + 2] << 8;
+        }
+
+        if(op == 0xCB) {
+            uop.handler = &CPU::block_cb;
+            block.cycles += cb_cycles(uop.imm) * 4;
+        } else {
+            uop.handler = block_table[op];
+            block.cycles += op_cycles[op] * 4;
+        }
+
+        block.ops.push_back(uop);
+        offset += length;
+
+        if(ends_block(op)) {
+            break;
+        }
+    }
+}
+
+void CPU::run_block(const Block& block, std::uint64_t until) {
+    std::uint32_t epoch = mmu.code_epoch;
+    // Only the last op can take a branch, so if the block as a whole ends
+    // before until none of the ops before it can reach it
+    bool check_until = cycles + block.cycles >= until;
+
+    for(const MicroOp& uop : block.ops) {
+        if(check_until && cycles >= until) {
+            return;
+        }
+        if(check_int()) {
+            // Like the interpreter, the first op of the handler always runs
+            (this->*op_table[fetch8()])();
+            return;
+        }
+        if(mmu.code_epoch != epoch || mmu.dma_active) {
+            return;
+        }
+
+        pc += uop.length;
+        cycles += uop.cycles;
+        if(cycles >= mmu.scheduler.next) {
+            service_events();
+        }
+
+        (this->*uop.handler)(uop);
+    }
+}
+
+void CPU::run_blocks(std::uint64_t until) {
+    while(cycles < until) {
+        // Fetches are blocked during OAM DMA, let read8 deal with it
+        Block *block = mmu.dma_active ? nullptr : find_block(pc);
+        if(block && !block->ops.empty()) {
+            if(use_jit && run_native(*block, until)) {
+                continue;
+            }
+            run_block(*block, until);
+        } else {
+            check_int();
+            (this->*op_table[fetch8()])();
+        }
+    }
+}
+
+}
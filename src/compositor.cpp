@@ -0,0 +1,127 @@
+#include <cstdlib>
+#include <string_view>
+#include <fmt/format.h>
+#include "compositor.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace gb {
+
+namespace {
+
+void compose_scalar(const u8 *bg, const u8 *obj, const LinePalette& palette, std::uint32_t *out, std::size_t width) {
+    for(std::size_t x = 0; x < width; x++) {
+        out[x] = palette.get(obj[x] ? obj[x] : bg[x]);
+    }
+}
+
+#if defined(__x86_64__)
+
+// 16 pixels: merge the layers into palette indexes, look each channel up
+// and interleave the planes back into ARGB
+__attribute__((target("ssse3")))
+void compose_ssse3(const u8 *bg, const u8 *obj, const LinePalette& palette, std::uint32_t *out, std::size_t width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.b.data()));
+    const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.g.data()));
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.r.data()));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.a.data()));
+
+    std::size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        __m128i back = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bg + x));
+        __m128i front = _mm_loadu_si128(reinterpret_cast<const __m128i *>(obj + x));
+        // Background only where there's no sprite pixel
+        __m128i index = _mm_or_si128(front, _mm_and_si128(back, _mm_cmpeq_epi8(front, zero)));
+
+        __m128i bg_lo = _mm_unpacklo_epi8(_mm_shuffle_epi8(b, index), _mm_shuffle_epi8(g, index));
+        __m128i bg_hi = _mm_unpackhi_epi8(_mm_shuffle_epi8(b, index), _mm_shuffle_epi8(g, index));
+        __m128i ra_lo = _mm_unpacklo_epi8(_mm_shuffle_epi8(r, index), _mm_shuffle_epi8(a, index));
+        __m128i ra_hi = _mm_unpackhi_epi8(_mm_shuffle_epi8(r, index), _mm_shuffle_epi8(a, index));
+
+        __m128i *dst = reinterpret_cast<__m128i *>(out + x);
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+    }
+
+    compose_scalar(bg + x, obj + x, palette, out + x, width - x);
+}
+
+// Same as the SSSE3 version on 32 pixels. Shuffles and unpacks stay within
+// 128 bit lanes, so the halves are put back in order before storing
+__attribute__((target("avx2")))
+void compose_avx2(const u8 *bg, const u8 *obj, const LinePalette& palette, std::uint32_t *out, std::size_t width) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i b = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.b.data())));
+    const __m256i g = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.g.data())));
+    const __m256i r = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.r.data())));
+    const __m256i a = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.a.data())));
+
+    std::size_t x = 0;
+    for(; x + 32 <= width; x += 32) {
+        __m256i back = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bg + x));
+        __m256i front = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(obj + x));
+        __m256i index = _mm256_or_si256(front, _mm256_and_si256(back, _mm256_cmpeq_epi8(front, zero)));
+
+        __m256i bg_lo = _mm256_unpacklo_epi8(_mm256_shuffle_epi8(b, index), _mm256_shuffle_epi8(g, index));
+        __m256i bg_hi = _mm256_unpackhi_epi8(_mm256_shuffle_epi8(b, index), _mm256_shuffle_epi8(g, index));
+        __m256i ra_lo = _mm256_unpacklo_epi8(_mm256_shuffle_epi8(r, index), _mm256_shuffle_epi8(a, index));
+        __m256i ra_hi = _mm256_unpackhi_epi8(_mm256_shuffle_epi8(r, index), _mm256_shuffle_epi8(a, index));
+
+        // Pixels 0-3 and 16-19, 4-7 and 20-23, and so on
+        __m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+        __m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+        __m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+        __m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+
+        __m256i *dst = reinterpret_cast<__m256i *>(out + x);
+        _mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+
+    // The tail call below skips the vzeroupper GCC would put before a ret,
+    // leaving the upper halves dirty slows down SSE code in the caller
+    _mm256_zeroupper();
+    compose_scalar(bg + x, obj + x, palette, out + x, width - x);
+}
+
+#endif
+
+}
+
+Compositor select_compositor() {
+    std::string_view name;
+    if(const char *env = std::getenv("GB_COMPOSITOR")) {
+        name = env;
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool ssse3 = __builtin_cpu_supports("ssse3");
+
+    if(name.empty() || name == "avx2") {
+        if(avx2) {
+            return compose_avx2;
+        }
+    }
+    if(name.empty() || name == "avx2" || name == "ssse3") {
+        if(ssse3) {
+            return compose_ssse3;
+        }
+    }
+#endif
+
+    if(!name.empty() && name != "scalar") {
+        fmt::print("GB_COMPOSITOR={} isn't supported, using scalar\n", name);
+    }
+    return compose_scalar;
+}
+
+}
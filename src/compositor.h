@@ -0,0 +1,41 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "types.h"
+
+namespace gb {
+
+// Colours used on one line, stored as byte planes so the SIMD compositors
+// can look up 16 pixels per channel with one byte shuffle. Index 0-3 is a
+// background colour, 4 + palette * 4 + colour a sprite colour.
+struct LinePalette {
+    // Background and window switched off by LCDC bit 0
+    static constexpr u8 blank = 12;
+
+    void set(u8 index, std::uint32_t argb) {
+        b[index] = argb;
+        g[index] = argb >> 8;
+        r[index] = argb >> 16;
+        a[index] = argb >> 24;
+    }
+
+    std::uint32_t get(u8 index) const {
+        return std::uint32_t(a[index]) << 24 | r[index] << 16 | g[index] << 8 | b[index];
+    }
+
+    std::array<u8, 16> b = {};
+    std::array<u8, 16> g = {};
+    std::array<u8, 16> r = {};
+    std::array<u8, 16> a = {};
+};
+
+// Writes width pixels to out. bg holds background colours 0-3, obj is 0
+// where the background shows through and a LinePalette index otherwise
+using Compositor = void (*)(const u8 *bg, const u8 *obj, const LinePalette& palette, std::uint32_t *out, std::size_t width);
+
+// AVX2, SSSE3 or scalar, whichever the host supports. GB_COMPOSITOR set to
+// one of those names overrides it
+Compositor select_compositor();
+
+}
@@ -1,18 +1,20 @@
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
 #include <fmt/format.h>
-#include <SDL2/SDL.h>
 #include "cpu.h"
+#include "opcodes.h"
 
 namespace gb {
 
-CPU::CPU(MMU& mmu) : mmu(mmu), gpu(mmu) {
+CPU::CPU(MMU& mmu) : cycles(mmu.scheduler.cycles), mmu(mmu), gpu(mmu) {
 
 }
 
 
 u8 CPU::fetch8() {
-    u8 result = read8(pc++);
-    clock();
-    return result;
+    return read8(pc++);
 }
 
 u16 CPU::fetch16() {
@@ -23,7 +25,11 @@ void CPU::write8(u16 addr, u8 value) {
     if(addr >= 0x8000 && addr <= 0x9FFF) {
         //fmt::print("Write {:02X} to {:04X}\n", value, addr);
     }
-    mmu[addr] = value;
+    if(!mmu.dma_blocked(addr)) {
+        mmu[addr] = value;
+    }
+    mem_policy.write(pc, addr, value);
+    tracer.write(addr);
     clock();
 }
 
@@ -33,7 +39,8 @@ void CPU::write16(u16 addr, u16 value) {
 }
 
 u8 CPU::read8(u16 addr) {
-    u8 result = mmu[addr];
+    u8 result = mmu.dma_blocked(addr) ? 0xFF : mmu[addr];
+    mem_policy.read(pc, addr, result);
     clock();
     return result;
 }
@@ -44,51 +51,50 @@ u16 CPU::read16(u16 addr) {
 
 void CPU::clock() {
     cycles += 4;
-    gpu.step(4);
-
-    static int DIVCnt = 0;
-
-    DIVCnt += 4;
-
-    if(DIVCnt > 256) {
-        mmu.io.DIVA += 1;
-        DIVCnt = 0;
-    }
-
-    const Uint8 *state = SDL_GetKeyboardState(NULL);
-            
-    mmu.io.JOYP |= 0b0000'1111;
-
-    if((mmu.io.JOYP & 0b0010'0000) == 0) {
-        if(state[SDL_SCANCODE_Z])
-            mmu.io.JOYP &= ~1;
-        if(state[SDL_SCANCODE_X])
-            mmu.io.JOYP &= ~2;
-        if(state[SDL_SCANCODE_BACKSPACE])
-            mmu.io.JOYP &= ~4;
-        if(state[SDL_SCANCODE_RETURN])
-            mmu.io.JOYP &= ~8;
-    } else if((mmu.io.JOYP & 0b0001'0000) == 0) {
-        // R L U D
-        if(state[SDL_SCANCODE_RIGHT])
-            mmu.io.JOYP &= ~1;
-        if(state[SDL_SCANCODE_LEFT])
-            mmu.io.JOYP &= ~2;
-        if(state[SDL_SCANCODE_UP])
-            mmu.io.JOYP &= ~4;
-        if(state[SDL_SCANCODE_DOWN])
-            mmu.io.JOYP &= ~8;
+
+    if(cycles >= mmu.scheduler.next) {
+        service_events();
     }
-    
 }
 
-void CPU::check_int() {
+void CPU::service_events() {
+    Event event;
+    std::uint64_t when;
+
+    while(mmu.scheduler.pop(event, when)) {
+        switch(event) {
+            case Event::LCD:
+                // Lines are only rendered when something they read is
+                // written, or here once the frame is complete
+                if(mmu.lcd.advance(when)) {
+                    gpu.catch_up();
+                }
+                break;
+            case Event::Timer:
+                mmu.timer.overflow(when);
+                break;
+            case Event::DMA:
+                mmu.dma_active = false;
+                break;
+            case Event::Serial:
+                mmu.io.SB = 0xFF;
+                mmu.io.SC &= 0b0111'1111;
+                mmu.io.IF |= 0b0000'1000;
+                break;
+            case Event::Count:
+                break;
+        }
+    }
+}
+
+bool CPU::check_int() {
     /*if(pc == 0xC2BE || pc == 0xC2C0) {
         fmt::print("IE: {:08b} IF: {:08b} ime: {}\n", mmu.IE, mmu.io.IF, ime);
     }*/
     if(ime) {
-        if(mmu.IE & mmu.io.IF) {
-            u8 mask = mmu.io.IF & (-mmu.io.IF);
+        u8 pending = mmu.IE & mmu.io.IF;
+        if(pending) {
+            u8 mask = pending & (-pending);
             // 00001 = 1 = 0x40 = 64 = 0
             // 00010 = 2 = 0x48 = 72 = 8
             // 00100 = 4 = 0x50 = 80 = 16
@@ -116,376 +122,302 @@ void CPU::check_int() {
 
             op_rst(rst);
             //fmt::print("IE: {:08b} IF: {:08b} ime: {}\n", mmu.IE, mmu.io.IF, ime);
+            return true;
         }
 
     }
+    return false;
+}
+
+// Explicit specialisations for every base opcode, see opcodes.h
+#define GB_DEFINE_OP(opcode, ...) \
+    template<> void CPU::op<0x##opcode>() { __VA_ARGS__ }
+GB_OPCODES(GB_DEFINE_OP)
+#undef GB_DEFINE_OP
+
+#define GB_OP_HANDLER(opcode, ...) &CPU::op<0x##opcode>,
+const std::array<CPU::Handler, 256> CPU::op_table = { GB_OPCODES(GB_OP_HANDLER) };
+#undef GB_OP_HANDLER
+
+// CB prefixed opcodes are regular enough to be generated, x picks the
+// operation, y the bit or rotate and z the register
+template<u8 op>
+void CPU::op_cb() {
+    constexpr u8 x = op >> 6;
+    constexpr u8 y = (op >> 3) & 0b111;
+    constexpr u8 z = op & 0b111;
+
+    if constexpr(x == 0) {
+        constexpr decltype(&CPU::bit_rl) fn[] = { &CPU::bit_rlc, &CPU::bit_rrc, &CPU::bit_rl, &CPU::bit_rr, &CPU::bit_sla, &CPU::bit_sra, &CPU::bit_swap, &CPU::bit_srl };
+        set_reg<z>((this->*fn[y])(get_reg<z>(), false));
+    } else if constexpr(x == 1) {
+        bit_test(get_reg<z>(), y);
+    } else if constexpr(x == 2) {
+        set_reg<z>(bit_reset(get_reg<z>(), y));
+    } else {
+        set_reg<z>(bit_set(get_reg<z>(), y));
+    }
+}
+
+template<std::size_t... op>
+static constexpr std::array<CPU::Handler, 256> make_cb_table(std::index_sequence<op...>) {
+    return { &CPU::op_cb<op>... };
+}
+
+const std::array<CPU::Handler, 256> CPU::cb_table = make_cb_table(std::make_index_sequence<256>{});
+
+template<u8 z>
+u8 CPU::get_reg() {
+    if constexpr(z == 0) return b;
+    else if constexpr(z == 1) return c;
+    else if constexpr(z == 2) return d;
+    else if constexpr(z == 3) return e;
+    else if constexpr(z == 4) return h;
+    else if constexpr(z == 5) return l;
+    else if constexpr(z == 6) return read8(hl);
+    else return a;
+}
+
+template<u8 z>
+void CPU::set_reg(u8 value) {
+    if constexpr(z == 0) b = value;
+    else if constexpr(z == 1) c = value;
+    else if constexpr(z == 2) d = value;
+    else if constexpr(z == 3) e = value;
+    else if constexpr(z == 4) h = value;
+    else if constexpr(z == 5) l = value;
+    else if constexpr(z == 6) write8(hl, value);
+    else a = value;
 }
 
 void CPU::step() {
+    // A HALT/STOP can idle at most until the next event, or not at all
+    // when nothing is scheduled
+    run_until = mmu.scheduler.next == Scheduler::never ? cycles : mmu.scheduler.next;
 
-    //mmu.io.JOYP = 0b0001111;
-    check_int();
+    if(!resume_sleep()) {
+        return;
+    }
 
-    u8 ins = fetch8();
-
-    switch(ins) {
-        case 0x00: break;
-        case 0x01: bc = fetch16(); break;
-        case 0x02: write8(bc, a); break;
-        case 0x03: ++bc; break;
-        case 0x04: b = alu_inc(b); break;
-        case 0x05: b = alu_dec(b); break;
-        case 0x06: b = fetch8(); break;
-        case 0x07: a = bit_rlc(a, true); break;
-
-        case 0x08: write16(fetch16(), sp); break;
-        case 0x09: hl = alu_add16(hl, bc); break;
-        case 0x0A: a = read8(bc); break;
-        case 0x0B: --bc; break;
-        case 0x0C: c = alu_inc(c); break;
-        case 0x0D: c = alu_dec(c); break;
-        case 0x0E: c = fetch8(); break;
-        case 0x0F: a = bit_rrc(a, true); break;
-
-        case 0x11: de = fetch16(); break;
-        case 0x12: write8(de, a); break;
-        case 0x13: ++de; break;
-        case 0x14: d = alu_inc(d); break;
-        case 0x15: d = alu_dec(d); break;
-        case 0x16: d = fetch8(); break;
-        case 0x17: a = bit_rl(a, true); break;
-
-        case 0x18: op_jr(Condition::None, fetch8()); break;
-        case 0x19: hl = alu_add16(hl, de); break;
-        case 0x1A: a = read8(de); break;
-        case 0x1B: --de; break;
-        case 0x1C: e = alu_inc(e); break;
-        case 0x1D: e = alu_dec(e); break;
-        case 0x1E: e = fetch8(); break;
-        case 0x1F: a = bit_rr(a, true); break;
-
-        case 0x20: op_jr(Condition::NZ, fetch8()); break;
-        case 0x21: hl = fetch16(); break;
-        case 0x22: write8(hl++, a); break;
-        case 0x23: ++hl; break;
-        case 0x24: h = alu_inc(h); break;
-        case 0x25: h = alu_dec(h); break;
-        case 0x26: h = fetch8(); break;
-        case 0x27: break;
-
-        case 0x28: op_jr(Condition::Z, fetch8()); break;
-        case 0x29: hl = alu_add16(hl, hl); break;
-        case 0x2A: a = read8(hl++); break;
-        case 0x2B: --hl; break;
-        case 0x2C: l = alu_inc(l); break;
-        case 0x2D: l = alu_dec(l); break;
-        case 0x2E: l = fetch8(); break;
-        case 0x2F: a = ~a; f.n = true; f.h = true; break;
-
-        case 0x30: op_jr(Condition::NC, fetch8()); break;
-        case 0x31: sp = fetch16(); break;
-        case 0x32: write8(hl--, a); break;
-        case 0x33: ++sp; break;
-        case 0x34: write8(hl, alu_inc(read8(hl))); break;
-        case 0x35: write8(hl, alu_dec(read8(hl))); break;
-        case 0x36: write8(hl, fetch8()); break;
-        case 0x37: f.n = false; f.h = false; f.c = true; break;
-
-        case 0x38: op_jr(Condition::C, fetch8()); break;
-        case 0x39: hl = alu_add16(hl, sp); break;
-        case 0x3A: a = read8(hl--); break;
-        case 0x3B: --sp; break;
-        case 0x3C: a = alu_inc(a); break;
-        case 0x3D: a = alu_dec(a); break;
-        case 0x3E: a = fetch8(); break;
-        case 0x3F: f.n = false; f.h = false; f.c = !f.c; break;
-
-        case 0x40: break; // a = a
-        case 0x41: b = c; break;
-        case 0x42: b = d; break;
-        case 0x43: b = e; break;
-        case 0x44: b = h; break;
-        case 0x45: b = l; break;
-        case 0x46: b = read8(hl); break;
-        case 0x47: b = a; break;
-
-        case 0x48: c = b; break;
-        case 0x49: break; // c = c
-        case 0x4A: c = d; break;
-        case 0x4B: c = e; break;
-        case 0x4C: c = h; break;
-        case 0x4D: c = l; break;
-        case 0x4E: c = read8(hl); break;
-        case 0x4F: c = a; break;
-
-        case 0x50: d = b; break;
-        case 0x51: d = c; break;
-        case 0x52: break; // d = d
-        case 0x53: d = e; break;
-        case 0x54: d = h; break;
-        case 0x55: d = l; break;
-        case 0x56: d = read8(hl); break;
-        case 0x57: d = a; break;
-
-        case 0x58: e = b; break;
-        case 0x59: e = c; break;
-        case 0x5A: e = d; break;
-        case 0x5B: break; // e = e
-        case 0x5C: e = h; break;
-        case 0x5D: e = l; break;
-        case 0x5E: e = read8(hl); break;
-        case 0x5F: e = a; break;
-
-        case 0x60: h = b; break;
-        case 0x61: h = c; break;
-        case 0x62: h = d; break;
-        case 0x63: h = e; break;
-        case 0x64: break; // h = h
-        case 0x65: h = l; break;
-        case 0x66: h = read8(hl); break;
-        case 0x67: h = a; break;
-
-        case 0x68: l = b; break;
-        case 0x69: l = c; break;
-        case 0x6A: l = d; break;
-        case 0x6B: l = e; break;
-        case 0x6C: l = h; break;
-        case 0x6D: break; // l = l
-        case 0x6E: l = read8(hl); break;
-        case 0x6F: l = a; break;
-
-        case 0x70: write8(hl, b); break;
-        case 0x71: write8(hl, c); break;
-        case 0x72: write8(hl, d); break;
-        case 0x73: write8(hl, e); break;
-        case 0x74: write8(hl, h); break;
-        case 0x75: write8(hl, l); break;
-        
-        case 0x76: break;
-
-        case 0x77: write8(hl, a); break;
-
-        case 0x78: a = b; break;
-        case 0x79: a = c; break;
-        case 0x7A: a = d; break;
-        case 0x7B: a = e; break;
-        case 0x7C: a = h; break;
-        case 0x7D: a = l; break;
-        case 0x7E: a = read8(hl); break;
-        case 0x7F: break; // a = a
-
-        case 0x80: a = alu_add(a, b, false); break;
-        case 0x81: a = alu_add(a, c, false); break;
-        case 0x82: a = alu_add(a, d, false); break;
-        case 0x83: a = alu_add(a, e, false); break;
-        case 0x84: a = alu_add(a, h, false); break;
-        case 0x85: a = alu_add(a, l, false); break;
-        case 0x86: a = alu_add(a, read8(hl), false); break;
-        case 0x87: a = alu_add(a, a, false); break;
-
-        case 0x88: a = alu_add(a, b, true); break;
-        case 0x89: a = alu_add(a, c, true); break;
-        case 0x8A: a = alu_add(a, d, true); break;
-        case 0x8B: a = alu_add(a, e, true); break;
-        case 0x8C: a = alu_add(a, h, true); break;
-        case 0x8D: a = alu_add(a, l, true); break;
-        case 0x8E: a = alu_add(a, read8(hl), true); break;
-        case 0x8F: a = alu_add(a, a, true); break;
-
-        case 0x90: a = alu_sub(a, b, false); break;
-        case 0x91: a = alu_sub(a, c, false); break;
-        case 0x92: a = alu_sub(a, d, false); break;
-        case 0x93: a = alu_sub(a, e, false); break;
-        case 0x94: a = alu_sub(a, h, false); break;
-        case 0x95: a = alu_sub(a, l, false); break;
-        case 0x96: a = alu_sub(a, read8(hl), false); break;
-        case 0x97: a = alu_sub(a, a, false); break;
-
-        case 0x98: a = alu_sub(a, b, true); break;
-        case 0x99: a = alu_sub(a, c, true); break;
-        case 0x9A: a = alu_sub(a, d, true); break;
-        case 0x9B: a = alu_sub(a, e, true); break;
-        case 0x9C: a = alu_sub(a, h, true); break;
-        case 0x9D: a = alu_sub(a, l, true); break;
-        case 0x9E: a = alu_sub(a, read8(hl), true); break;
-        case 0x9F: a = alu_sub(a, a, true); break;
-        
-        case 0xA0: a = alu_and(a, b); break;
-        case 0xA1: a = alu_and(a, c); break;
-        case 0xA2: a = alu_and(a, d); break;
-        case 0xA3: a = alu_and(a, e); break;
-        case 0xA4: a = alu_and(a, h); break;
-        case 0xA5: a = alu_and(a, l); break;
-        case 0xA6: a = alu_and(a, read8(hl)); break;
-        case 0xA7: a = alu_and(a, a); break;
-
-        case 0xA8: a = alu_xor(a, b); break;
-        case 0xA9: a = alu_xor(a, c); break;
-        case 0xAA: a = alu_xor(a, d); break;
-        case 0xAB: a = alu_xor(a, e); break;
-        case 0xAC: a = alu_xor(a, h); break;
-        case 0xAD: a = alu_xor(a, l); break;
-        case 0xAE: a = alu_xor(a, read8(hl)); break;
-        case 0xAF: a = alu_xor(a, a); break;
-        
-        case 0xB0: a = alu_or(a, b); break;
-        case 0xB1: a = alu_or(a, c); break;
-        case 0xB2: a = alu_or(a, d); break;
-        case 0xB3: a = alu_or(a, e); break;
-        case 0xB4: a = alu_or(a, h); break;
-        case 0xB5: a = alu_or(a, l); break;
-        case 0xB6: a = alu_or(a, read8(hl)); break;
-        case 0xB7: a = alu_or(a, a); break;
-        
-        case 0xB8: alu_sub(a, b, false); break;
-        case 0xB9: alu_sub(a, c, false); break;
-        case 0xBA: alu_sub(a, d, false); break;
-        case 0xBB: alu_sub(a, e, false); break;
-        case 0xBC: alu_sub(a, h, false); break;
-        case 0xBD: alu_sub(a, l, false); break;
-        case 0xBE: alu_sub(a, read8(hl), false); break;
-        case 0xBF: alu_sub(a, a, false); break;
-        
-        case 0xC0: op_ret(Condition::NZ); break;
-        case 0xC1: bc = pop(); break;
-        case 0xC2: op_jump(Condition::NZ, fetch16()); break;
-        case 0xC3: op_jump(Condition::None, fetch16()); break;
-        case 0xC4: op_call(Condition::NZ, fetch16()); break;
-        case 0xC5: clock(); push(bc); break;
-        case 0xC6: a = alu_add(a, fetch8(), false); break;
-        case 0xC7: op_rst(0x00); break;
-
-        case 0xC8: op_ret(Condition::Z); break;
-        case 0xC9: op_ret(Condition::None); break;
-        case 0xCA: op_jump(Condition::Z, fetch16()); break;
-        case 0xCB: op_cb(); break;
-        case 0xCC: op_call(Condition::Z, fetch16()); break;
-        case 0xCD: op_call(Condition::None, fetch16()); break;
-        case 0xCE: a = alu_add(a, fetch8(), true); break;
-        case 0xCF: op_rst(0x08); break;
-
-        case 0xD0: op_ret(Condition::NZ); break;
-        case 0xD1: de = pop(); break;
-        case 0xD2: op_jump(Condition::NC, fetch16()); break;
-        // D3
-        case 0xD4: op_call(Condition::NC, fetch16()); break;
-        case 0xD5: clock(); push(de); break;
-        case 0xD6: a = alu_sub(a, fetch8(), false); break;
-        case 0xD7: op_rst(0x10); break;
-
-        case 0xD8: op_ret(Condition::C); break;
-        case 0xD9: ime = true; pc = pop(); clock(); break;
-        case 0xDA: op_jump(Condition::C, fetch16()); break;
-        // DB
-        case 0xDC: op_call(Condition::C, fetch16()); break;
-        // DD
-        case 0xDE: a = alu_sub(a, fetch8(), true); break;
-        case 0xDF: op_rst(0x18); break;
-
-        case 0xE0: write8(0xFF00 + fetch8(), a); break;
-        case 0xE1: hl = pop(); break;
-        case 0xE2: write8(0xFF00 + c, a); break;
-        // E3
-        // E4
-        case 0xE5: clock(); push(hl); break;
-        case 0xE6: a = alu_and(a, fetch8()); break;
-        case 0xE7: op_rst(0x20); break;
-
-        case 0xE8: sp += (i8) fetch8(); break;
-        case 0xE9: pc = hl; break;
-        case 0xEA: write8(fetch16(), a); break;
-        // EB
-        // EC
-        // ED
-        case 0xEE: a = alu_xor(a, fetch8()); break;
-        case 0xEF: op_rst(0x28); break;
-
-        case 0xF0: a = read8(0xFF00 + fetch8()); break;
-        case 0xF1: af = pop(); break;
-        case 0xF2: a = read8(0xFF00 + c); break;
-        case 0xF3: ime = false; break;
-        // F4
-        case 0xF5: clock(); push(af); break;
-        case 0xF6: a = alu_or(a, fetch8()); break;
-        case 0xF7: op_rst(0x30); break;
-        case 0xF8: hl = sp + (i8) fetch8(); break;
-        case 0xF9: sp = hl; break;
-
-        case 0xFA: a = read8(fetch16()); break;
-        case 0xFB: ime = true; break;
-        // FC
-        // FD
-        case 0xFE: alu_sub(a, fetch8(), false); break;
-        case 0xFF: op_rst(0x38); break;
-        default: fmt::print("Unknown opcode {:02X} at {:04X}", ins, pc - 1); exit(0); break;
+    if constexpr(Profiler::enabled || Tracer::enabled) {
+        execute_instrumented();
+        return;
     }
 
-    /*if(pc == 0xC2BE || pc == 0xC2C0) {
-        fmt::print("IE: {:08b} IF: {:08b} ime: {}\n", mmu.IE, mmu.io.IF, ime);
-    }*/
+    check_int();
 
+    (this->*op_table[fetch8()])();
 }
 
-void CPU::op_cb() {
-    u8 ins = fetch8();
-    u8 x = ins >> 6;
-    u8 y = (ins >> 3) & 0b111;
-    u8 z = ins & 0b111;
-
-    decltype(&CPU::bit_rl) fn[] = { &CPU::bit_rlc, &CPU::bit_rrc, &CPU::bit_rl, &CPU::bit_rr, &CPU::bit_sla, &CPU::bit_sra, &CPU::bit_swap, &CPU::bit_srl };
-
-    if(x == 0) {
-        switch(z) {
-            case 0: b = (this->*fn[y])(b, false); break;
-            case 1: c = (this->*fn[y])(c, false); break;
-            case 2: d = (this->*fn[y])(d, false); break;
-            case 3: e = (this->*fn[y])(e, false); break;
-            case 4: h = (this->*fn[y])(h, false); break;
-            case 5: l = (this->*fn[y])(l, false); break;
-            case 6: write8(hl, (this->*fn[y])(read8(hl), false)); break;
-            case 7: a = (this->*fn[y])(a, false); break;
-        }
+void CPU::execute_instrumented() {
+    if constexpr(Tracer::enabled) {
+        trace();
+    }
 
-    } else if(x == 1) {
-        switch(z) {
-            case 0: bit_test(b, y); break;
-            case 1: bit_test(c, y); break;
-            case 2: bit_test(d, y); break;
-            case 3: bit_test(e, y); break;
-            case 4: bit_test(h, y); break;
-            case 5: bit_test(l, y); break;
-            case 6: bit_test(read8(hl), y); break;
-            case 7: bit_test(a, y); break;
+    if constexpr(Profiler::enabled) {
+        execute_profiled();
+    } else {
+        check_int();
+        (this->*op_table[fetch8()])();
+    }
+}
+
+void CPU::trace() {
+    if(!tracer.wants(pc, cycles)) {
+        return;
+    }
+
+    TraceRecord record;
+    record.cycles = cycles;
+    record.pc = pc;
+    record.sp = sp;
+    record.a = a;
+    record.f = f;
+    record.b = b;
+    record.c = c;
+    record.d = d;
+    record.e = e;
+    record.h = h;
+    record.l = l;
+
+    const u8 *page = mmu.read_page(pc);
+    if(page && (pc & 0xFF) <= 0xFC) {
+        std::memcpy(record.bytes.data(), page + (pc & 0xFF), 4);
+    } else {
+        for(int i = 0; i < 4; i++) {
+            record.bytes[i] = mmu[pc + i];
         }
-    } else if(x == 2) {
-        switch(z) {
-            case 0: b = bit_reset(b, y); break;
-            case 1: c = bit_reset(c, y); break;
-            case 2: d = bit_reset(d, y); break;
-            case 3: e = bit_reset(e, y); break;
-            case 4: h = bit_reset(h, y); break;
-            case 5: l = bit_reset(l, y); break;
-            case 6: write8(hl, bit_reset(read8(hl), y)); break;
-            case 7: a = bit_reset(a, y); break;
+    }
+
+    tracer.record(record);
+}
+
+void CPU::execute_profiled() {
+    std::uint64_t start = cycles;
+    if(check_int()) {
+        profiler.interrupt(pc, cycles - start, cycles);
+    }
+
+    u16 at = pc;
+    u16 stack = sp;
+    u8 op = mmu[at];
+    u8 cb = op == 0xCB ? mmu[at + 1] : 0;
+    u16 bank = code_bank(at);
+    start = cycles;
+
+    (this->*op_table[fetch8()])();
+
+    profiler.instruction(bank, at, op, cb, cycles - start);
+
+    // The stack moving tells whether a conditional CALL/RET was taken
+    switch(op) {
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            if(sp == u16(stack - 2)) {
+                profiler.call(code_bank(pc), pc, cycles);
+            }
+            break;
+        case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9:
+            if(sp == u16(stack + 2)) {
+                profiler.ret(cycles);
+            }
+            break;
+    }
+}
+
+u16 CPU::code_bank(u16 addr) const {
+    if(addr <= 0x3FFF) {
+        return mmu.rom_bank0;
+    } else if(addr <= 0x7FFF) {
+        return mmu.rom_bank;
+    }
+    return 0;
+}
+
+void CPU::run(std::uint64_t until) {
+    run_until = until;
+
+    if(!resume_sleep()) {
+        return;
+    }
+
+    if constexpr(Profiler::enabled || Tracer::enabled) {
+        // Every instruction has to be seen, so no blocks or threaded dispatch
+        while(cycles < until) {
+            execute_instrumented();
         }
-    } else if(x == 3) {
-        switch(z) {
-            case 0: b = bit_set(b, y); break;
-            case 1: c = bit_set(c, y); break;
-            case 2: d = bit_set(d, y); break;
-            case 3: e = bit_set(e, y); break;
-            case 4: h = bit_set(h, y); break;
-            case 5: l = bit_set(l, y); break;
-            case 6: write8(hl, bit_set(read8(hl), y)); break;
-            case 7: a = bit_set(a, y); break;
+        return;
+    }
+
+    // Predecoded blocks never fetch their opcodes and immediates through
+    // read8, so counting and watchpoint builds have to fetch every byte
+    if(use_block_cache && std::is_same_v<MemoryPolicy, NullPolicy>) {
+        run_blocks(until);
+        return;
+    }
+
+#if defined(__GNUC__)
+    // Threaded dispatch, every handler jumps straight to the next one
+    #define GB_OP_LABEL(opcode, ...) &&op_##opcode,
+    static const void *labels[256] = { GB_OPCODES(GB_OP_LABEL) };
+    #undef GB_OP_LABEL
+
+    #define GB_DISPATCH() \
+        if(cycles >= until) return; \
+        check_int(); \
+        goto *labels[fetch8()];
+
+    GB_DISPATCH();
+
+    #define GB_OP_BODY(opcode, ...) op_##opcode: { __VA_ARGS__ } GB_DISPATCH();
+    GB_OPCODES(GB_OP_BODY)
+    #undef GB_OP_BODY
+    #undef GB_DISPATCH
+#else
+    while(cycles < until) {
+        check_int();
+        (this->*op_table[fetch8()])();
+    }
+#endif
+}
+
+void CPU::op_cb() {
+    (this->*cb_table[fetch8()])();
+}
+
+bool CPU::interrupt_pending() const {
+    return mmu.IE & mmu.io.IF & 0b0001'1111;
+}
+
+bool CPU::button_pressed() const {
+    return (mmu.joypad.read(mmu.io.JOYP) & 0x0F) != 0x0F;
+}
+
+// Nothing can change until the next event, so skip straight to it instead
+// of executing the instructions in between. Returns false if the run ended
+// before woken() became true.
+template<typename Wake>
+bool CPU::idle(Wake woken) {
+    while(!woken()) {
+        // With nothing scheduled (LCD off, no timer) only the frontend can
+        // wake us, never must not be taken as the time of an event
+        if(mmu.scheduler.next == Scheduler::never || mmu.scheduler.next > run_until) {
+            cycles = std::max(cycles, (run_until + 3) & ~std::uint64_t(3));
+            return false;
         }
-    } else {
-        fmt::print("Unkown CB opcode x: {}, y: {}, z: {}", x, y, z);
-        exit(0);
+
+        cycles = mmu.scheduler.next;
+        service_events();
+    }
+    return true;
+}
+
+void CPU::op_halt() {
+    if(!ime && !ei_pending && interrupt_pending()) {
+        // HALT bug, the next opcode is executed without pc moving past it
+        (this->*op_table[read8(pc)])();
+        return;
     }
 
-    //fmt::print("x: {}, y: {}, z: {}", x, y, z);
+    // The next run carries on waiting, pc stays past the HALT so an
+    // interrupt taken in between returns after it
+    halted = !idle([this] { return interrupt_pending(); });
+}
+
+void CPU::op_stop() {
+    fetch8();
+    mmu.timer.write_div();
 
+    // Only a button press wakes the CPU back up
+    stopped = !idle([this] { return button_pressed(); });
+}
+
+bool CPU::resume_sleep() {
+    if(halted) {
+        halted = !idle([this] { return interrupt_pending(); });
+    }
+    if(stopped) {
+        stopped = !idle([this] { return button_pressed(); });
+    }
+    return !halted && !stopped;
+}
+
+void CPU::op_ei() {
+    // IME is only set once the following instruction has run
+    ei_pending = true;
+    (this->*op_table[fetch8()])();
+
+    if(ei_pending) {
+        ime = true;
+        ei_pending = false;
+    }
+}
+
+void CPU::op_unknown(u8 ins) {
+    fmt::print("Unknown opcode {:02X} at {:04X}", ins, pc - 1);
+    // exit() skips the destructors, keep what led here
+    tracer.save();
+    exit(0);
 }
 
 void CPU::push(u16 value) {
@@ -509,8 +441,8 @@ void CPU::op_call(Condition condition, u16 addr) {
     if(condition == Condition::None
     || condition == Condition::C && f.c
     || condition == Condition::NC && !f.c
-    || condition == Condition::Z && f.z
-    || condition == Condition::NZ && !f.z
+    || condition == Condition::Z && f.z()
+    || condition == Condition::NZ && !f.z()
     ) {
         clock();
         push(pc);
@@ -522,8 +454,8 @@ void CPU::op_jump(Condition condition, u16 addr) {
     if(condition == Condition::None
     || condition == Condition::C && f.c
     || condition == Condition::NC && !f.c
-    || condition == Condition::Z && f.z
-    || condition == Condition::NZ && !f.z
+    || condition == Condition::Z && f.z()
+    || condition == Condition::NZ && !f.z()
     ) {
         clock();
         pc = addr;
@@ -534,8 +466,8 @@ void CPU::op_ret(Condition condition) {
     if(condition == Condition::None
     || condition == Condition::C && f.c
     || condition == Condition::NC && !f.c
-    || condition == Condition::Z && f.z
-    || condition == Condition::NZ && !f.z
+    || condition == Condition::Z && f.z()
+    || condition == Condition::NZ && !f.z()
     ) {        
         u16 addr = pop();
         pc = addr;
@@ -549,18 +481,65 @@ void CPU::op_jr(Condition condition, i8 offset) {
     if(condition == Condition::None
     || condition == Condition::C && f.c
     || condition == Condition::NC && !f.c
-    || condition == Condition::Z && f.z
-    || condition == Condition::NZ && !f.z
+    || condition == Condition::Z && f.z()
+    || condition == Condition::NZ && !f.z()
     ) {
         pc = addr;
         clock();
+
+        if(offset == -6 && skip_idle_loops) {
+            skip_idle_loop();
+        }
+    }
+}
+
+void CPU::skip_idle_loop() {
+    // Polling loops like
+    //   LDH A, (LY)
+    //   CP n
+    //   JR NZ, -6
+    // only see a different value once an event has run, so whole
+    // iterations can be skipped up to the next one
+    u8 reg = mmu[pc + 1];
+    u8 cmp = mmu[pc + 2];
+    u8 jr = mmu[pc + 4];
+
+    if(mmu[pc] != 0xF0 || (reg != 0x41 && reg != 0x44)
+    || (cmp != 0xFE && cmp != 0xE6)
+    || (jr != 0x20 && jr != 0x28 && jr != 0x30 && jr != 0x38) || mmu[pc + 5] != 0xFA) {
+        return;
+    }
+
+    // An event may have run since the last read, only skip if the next
+    // iteration would see the same value
+    u8 value = mmu[0xFF00 + reg];
+    if(cmp == 0xE6) {
+        value &= mmu[pc + 3];
+    }
+
+    if(value != a) {
+        return;
+    }
+
+    // An interrupt that doesn't touch LY/STAT (timer, serial, joypad)
+    // has to be taken now rather than after the skip
+    if(ime && interrupt_pending()) {
+        return;
+    }
+
+    // LDH + CP/AND + JR taken
+    constexpr std::uint64_t iteration = 12 + 8 + 12;
+    std::uint64_t until = std::min(mmu.scheduler.next, run_until);
+
+    if(until > cycles) {
+        cycles += (until - cycles - 1) / iteration * iteration;
     }
 }
 
 u8 CPU::bit_test(u8 value, u8 bit) {
-    f.z = ~value & 1 << bit;
+    f.zero = value & 1 << bit;
     f.n = false;
-    f.h = true;
+    f.set_h(true);
     return value;
 }
 
@@ -569,8 +548,8 @@ u8 CPU::bit_rl(u8 value, bool accum) {
 
     u8 result = (value << 1) | f.c;
 
-    f.z = accum ? false : result == 0;
-    f.h = false;
+    f.zero = accum ? 1 : result;
+    f.set_h(false);
     f.n = false;
     f.c = carry_out;
 
@@ -582,8 +561,8 @@ u8 CPU::bit_rlc(u8 value, bool accum) {
 
     u8 result = (value << 1) | carry_out;
 
-    f.z = accum ? false : result == 0;
-    f.h = false;
+    f.zero = accum ? 1 : result;
+    f.set_h(false);
     f.n = false;
     f.c = carry_out;
 
@@ -595,8 +574,8 @@ u8 CPU::bit_rrc(u8 value, bool accum) {
 
     u8 result = (value >> 1) | (carry_out << 7);
 
-    f.z = accum ? false : result == 0;
-    f.h = false;
+    f.zero = accum ? 1 : result;
+    f.set_h(false);
     f.n = false;
     f.c = carry_out;
 
@@ -608,8 +587,8 @@ u8 CPU::bit_rr(u8 value, bool accum) {
 
     u8 result = (value >> 1) | (f.c << 7);
 
-    f.z = accum ? false : result == 0;
-    f.h = false;
+    f.zero = accum ? 1 : result;
+    f.set_h(false);
     f.n = false;
     f.c = carry_out;
 
@@ -621,8 +600,8 @@ u8 CPU::bit_srl(u8 value, bool) {
 
     u8 result = value >> 1;
 
-    f.z = result == 0;
-    f.h = 0;
+    f.zero = result;
+    f.set_h(false);
     f.n = 0;
     f.c = carry_out;
 
@@ -636,8 +615,8 @@ u8 CPU::bit_sra(u8 value, bool) {
 
     result = value & 0b1000'0000;
 
-    f.z = result == 0;
-    f.h = 0;
+    f.zero = result;
+    f.set_h(false);
     f.n = 0;
     f.c = carry_out;
 
@@ -649,8 +628,8 @@ u8 CPU::bit_sla(u8 value, bool) {
 
     u8 result = value << 1;
 
-    f.z = result == 0;
-    f.h = 0;
+    f.zero = result;
+    f.set_h(false);
     f.n = 0;
     f.c = carry_out;
 
@@ -662,8 +641,8 @@ u8 CPU::bit_swap(u8 value, bool) {
 
     u8 result = (value >> 4) | (value << 4);
 
-    f.z = result == 0;
-    f.h = false;
+    f.zero = result;
+    f.set_h(false);
     f.n = false;
     f.c = false;
 
@@ -695,9 +674,9 @@ void CPU::dump() {
         nextBytes[1],
         nextBytes[2],
         nextBytes[3],
-        (u8) f.z,
+        (u8) f.z(),
         (u8) f.n,
-        (u8) f.h,
+        (u8) f.h(),
         (u8) f.c,
         mmu.io.LY
         );
@@ -725,17 +704,17 @@ void CPU::dump_std() {
 u8 CPU::alu_xor(u8 lhs, u8 rhs) {
     u8 result = lhs ^ rhs;
     f.c = false;
-    f.h = false;
+    f.set_h(false);
     f.n = false;
-    f.z = result == 0;
+    f.zero = result;
     return result;
 }
 
 u8 CPU::alu_inc(u8 value) {
     u8 result = value + 1;
-    f.z = result == 0;
+    f.zero = result;
     f.n = false;
-    f.h = (value & 0xf) + 1 & 0x10;
+    f.set_h(Flags::Half::Add, value, 1);
 
     return result;
 
@@ -743,9 +722,9 @@ u8 CPU::alu_inc(u8 value) {
 
 u8 CPU::alu_dec(u8 value) {
     u8 result = value - 1;
-    f.z = result == 0;
+    f.zero = result;
     f.n = true;
-    f.h = (value & 0xf) - 1 & 0x10;
+    f.set_h(Flags::Half::Sub, value, 1);
 
     return result;
 
@@ -761,9 +740,9 @@ u8 CPU::alu_sub(u8 lhs, u8 rhs, bool carry_in) {
     }
 
 
-    f.z = result == 0;
+    f.zero = result;
     f.n = true;
-    f.h = (lhs & 0xf) - (rhs & 0xf) - (carry_in ? f.c : 0) & 0x10;
+    f.set_h(Flags::Half::Sub, lhs, rhs, carry_in && f.c);
     f.c = carry;
 
     return result;
@@ -778,9 +757,9 @@ u8 CPU::alu_add(u8 lhs, u8 rhs, bool carry_in) {
         carry |= __builtin_add_overflow(result, (u8) f.c, &result);
     }
 
-    f.z = result == 0;
+    f.zero = result;
     f.n = false;
-    f.h = (lhs & 0xf) + (rhs & 0xf) + (carry_in ? f.c : 0) & 0x10;
+    f.set_h(Flags::Half::Add, lhs, rhs, carry_in && f.c);
     f.c = carry;
 
     return result;
@@ -789,9 +768,9 @@ u8 CPU::alu_add(u8 lhs, u8 rhs, bool carry_in) {
 u8 CPU::alu_or(u8 lhs, u8 rhs) {
     u8 result = lhs | rhs;
 
-    f.z = result == 0;
+    f.zero = result;
     f.n = false;
-    f.h = false;
+    f.set_h(false);
     f.c = false;
 
     return result;
@@ -800,9 +779,9 @@ u8 CPU::alu_or(u8 lhs, u8 rhs) {
 u8 CPU::alu_and(u8 lhs, u8 rhs) {
     u8 result = lhs & rhs;
 
-    f.z = result == 0;
+    f.zero = result;
     f.n = false;
-    f.h = true;
+    f.set_h(true);
     f.c = false;
 
     return result;
@@ -816,7 +795,7 @@ u16 CPU::alu_add16(u16 lhs, u16 rhs) {
 
     f.c = carry;    
     f.n = false;
-    f.h = (lhs & 0xFFF) + (rhs & 0xFFF) & 0x1000;
+    f.set_h(Flags::Half::Add16, lhs, rhs);
 
     return result;
 }
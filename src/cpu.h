@@ -1,129 +1,84 @@
 #pragma once
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include "mmu.h"
 #include "types.h"
 #include "gpu.h"
+#include "instrument.h"
+#include "jit.h"
+#include "profiler.h"
+#include "trace.h"
 
 namespace gb {
 
-template<typename High, typename Low>
-class Register16 {
+// Z and H are evaluated lazily. ALU ops store the result and the half carry
+// operands, and the flag is only worked out when something reads it. Most
+// results are overwritten before anything looks at them.
+class Flags {
 public:
-    Register16(High& high, Low& low) : high(high), low(low) { }
-
-    u16 get() {
-        return high << 8 | low;
-    }
-
-    void set(u16 value) {
-        high = value >> 8;
-        low = value & 0xFF;
-    }
-
-    Register16& operator=(Register16& rhs) {
-        set(rhs);
-        return *this;
-    }
-
-    Register16& operator=(u16 rhs) {
-        set(rhs);
-        return *this;
-    }
-
-    Register16& operator+=(u16 rhs) {
-        set(get() + rhs);
-        return *this;
-    }
-
-    Register16& operator-=(u16 rhs) {
-        set(get() - rhs);
-        return *this;
-    }
-
-    u16 operator++(int dummy) {
-        u16 tmp = *this;
-        *this += 1;
-        return tmp;
-    }
-
-    u16 operator--(int dummy) {
-        u16 tmp = *this;
-        *this -= 1;
-        return tmp;
-    }
+    enum class Half : u8 {
+        Clear,
+        Set,
+        Add,
+        Sub,
+        Add16
+    };
 
-    u16 operator++() {
-        *this += 1;
+    Flags& operator=(u8 value) {
+        zero = (value & 0b1000'0000) ? 0 : 1;
+        n = value & 0b0100'0000;
+        set_h(value & 0b0010'0000);
+        c = value & 0b0001'0000;
         return *this;
     }
 
-    u16 operator--() {
-        *this -= 1;
-        return *this;
+    operator u8() const {
+        return z() << 7 | n << 6 | h() << 5 | c << 4;
     }
 
-    operator u16() {
-        return get();
+    bool z() const {
+        return zero == 0;
     }
 
-private:
-    High& high;
-    Low& low;
-};
-
-template<u8 bit>
-class Bit {
-public:
-    Bit(u8& src) : src(src) {
-
+    void set_z(bool value) {
+        zero = !value;
     }
 
-    Bit<bit>& operator=(bool value) {
-        if(value) {
-            src |= 1 << bit;
-        } else {
-            src &= ~(1 << bit);
+    bool h() const {
+        switch(half) {
+            case Half::Clear: return false;
+            case Half::Set: return true;
+            case Half::Add: return ((half_lhs & 0xF) + (half_rhs & 0xF) + half_carry) & 0x10;
+            case Half::Sub: return ((half_lhs & 0xF) - (half_rhs & 0xF) - half_carry) & 0x10;
+            case Half::Add16: return ((half_lhs & 0xFFF) + (half_rhs & 0xFFF)) & 0x1000;
         }
-        return *this;
+        return false;
     }
 
-    operator bool() {
-        return src & 1 << bit;
+    void set_h(bool value) {
+        half = value ? Half::Set : Half::Clear;
     }
-private:
-    u8& src;
-};
 
-class Flags {
-public:
-    Flags(u8 value) : value(value & 0b1111'0000) {
+    void set_h(Half op, u16 lhs, u16 rhs, bool carry_in = false) {
+        half = op;
+        half_lhs = lhs;
+        half_rhs = rhs;
+        half_carry = carry_in;
     }
 
-    Flags& operator=(Flags& rhs) {
-        value = rhs.value;
-        return *this;
-    }
-
-    Flags& operator=(u8 rhs) {
-        value = rhs & 0b1111'0000;
-        return *this;
-    }
-
-    operator u8() {
-        return value;
-    };
-
-
-
-    Bit<7> z{value};
-    Bit<6> n{value};
-    Bit<5> h{value};
-    Bit<4> c{value};
+    u8 zero = 1; // Last result, Z is set when it's 0
+    bool n = false;
+    bool c = false;
 
 private:
-    u8 value;
-};
-
+    friend class CPU; // The recompiler stores flags directly
 
+    Half half = Half::Clear;
+    u16 half_lhs = 0;
+    u16 half_rhs = 0;
+    bool half_carry = false;
+};
 
 class CPU {
 
@@ -136,6 +91,8 @@ class CPU {
     };
 
     public:
+    using Handler = void (CPU::*)();
+
     CPU(MMU& mmu);
 
     u8 fetch8();
@@ -148,8 +105,18 @@ class CPU {
     u16 read16(u16 addr);
 
     void clock();
+    void service_events();
 
     void step();
+    // One instruction through the interpreter, reported to the tracer and profiler
+    void execute_instrumented();
+    void execute_profiled();
+    // Records the state dump_std would print
+    void trace();
+    // ROM bank mapped at addr, 0 outside ROM
+    u16 code_bank(u16 addr) const;
+    // Runs whole instructions until cycles reaches until
+    void run(std::uint64_t until);
     void dump();
     void dump_std();
 
@@ -175,40 +142,143 @@ class CPU {
     u8 bit_sla(u8 value, bool);
     u8 bit_sra(u8 value, bool);
 
+    template<u8 op> void op();
+    template<u8 op> void op_cb();
+
     void op_cb();
+    void op_halt();
+    void op_stop();
+    void op_ei();
+    void op_unknown(u8 ins);
+
+    bool interrupt_pending() const;
+    bool button_pressed() const;
+    template<typename Wake> bool idle(Wake woken);
+    // Carries on a HALT/STOP the last run ended in, false while still asleep
+    bool resume_sleep();
+    void skip_idle_loop();
     void op_jump(Condition condition, u16 addr);
     void op_jr(Condition condition, i8 offset);
     void op_call(Condition condition, u16 addr);
     void op_ret(Condition condition);
     void op_rst(u16 addr);
 
-    void check_int();
+    // Services the highest priority pending interrupt, returns true if one was taken
+    bool check_int();
+
+    // Predecoded straight line code, see block.cpp
+    struct MicroOp;
+    using BlockHandler = void (CPU::*)(const MicroOp& uop);
+    using NativeBlock = void (*)(CPU *cpu);
+
+    struct MicroOp {
+        BlockHandler handler;
+        u16 imm; // Operand bytes, already fetched
+        u8 length;
+        u8 cycles; // Fetch cycles, the handler clocks the rest
+    };
+
+    struct Block {
+        std::vector<MicroOp> ops; // Empty when pc has to be interpreted
+        std::uint32_t cycles = 0; // Total with no branches taken
+        std::uint32_t hits = 0; // Times run, ROM blocks get compiled when hot
+        NativeBlock native = nullptr;
+        // pc native was compiled at, it bakes in absolute addresses but the
+        // same ROM bank can be mapped at both 0x0000 and 0x4000
+        u16 native_addr = 0;
+    };
+
+    // Blocks decoded from one 256 byte page of host memory
+    struct BlockPage {
+        std::uint32_t version = 0; // MMU::code_version when decoded
+        std::array<std::unique_ptr<Block>, 256> blocks;
+    };
+
+    template<u8 op> void block_op(const MicroOp& uop);
+    void block_cb(const MicroOp& uop);
+    Block *find_block(u16 addr);
+    void decode_block(Block& block, const u8 *page, u16 addr);
+    void run_block(const Block& block, std::uint64_t until);
+    void run_blocks(std::uint64_t until);
+
+    // x86-64 recompiler for hot ROM blocks, see jit.cpp
+    bool run_native(Block& block, std::uint64_t until);
+    NativeBlock compile_block(const Block& block, u16 addr);
+    static bool native_step(CPU *cpu, const MicroOp *uop);
+
+    static const std::array<BlockHandler, 256> block_table;
+
+    template<u8 z> u8 get_reg();
+    template<u8 z> void set_reg(u8 value);
+
+    static const std::array<Handler, 256> op_table;
+    static const std::array<Handler, 256> cb_table;
 
     void push(u16 value);
 
     u16 pop();
 
+    u16 af() const {
+        return a << 8 | f;
+    }
+
+    void set_af(u16 value) {
+        a = value >> 8;
+        f = value & 0xFF;
+    }
+
     u8 a = 0;
-    Flags f = 0;
-    u8 b = 0;
-    u8 c = 0;
-    u8 d = 0;
-    u8 e = 0;
-    u8 h = 0;
-    u8 l = 0;
+    Flags f;
+
+    // Register pairs share storage with their 8 bit halves
+    union {
+        struct {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            u8 c, b, e, d, l, h;
+#else
+            u8 b, c, d, e, h, l;
+#endif
+        };
+        struct {
+            u16 bc, de, hl;
+        };
+        std::array<u8, 6> regs = {};
+    };
+
     u16 pc = 0;
     u16 sp = 0;
 
-    std::uint64_t cycles = 0;
-
-    Register16<u8, Flags> af{a, f};
-    Register16<u8, u8> bc{b, c};
-    Register16<u8, u8> de{d, e};
-    Register16<u8, u8> hl{h, l};
+    // Lives in the scheduler so events can be timed from the MMU
+    std::uint64_t& cycles;
 
     MMU& mmu;
     GPU gpu;
+    MemoryPolicy mem_policy;
+    Profiler profiler;
+    Tracer tracer;
     bool ime = false;
+    bool ei_pending = false; // EI ran, IME is set after the next instruction
+    // A HALT/STOP reached the end of a run with pc already past it
+    bool halted = false;
+    bool stopped = false;
+
+    // Fast forward through LY/STAT polling loops, see skip_idle_loop
+    bool skip_idle_loops = true;
+    // run() executes predecoded blocks instead of fetching every byte
+    bool use_block_cache = true;
+    // Keyed by the page's host memory so every bank gets its own blocks
+    std::unordered_map<const u8 *, std::unique_ptr<BlockPage>> block_pages;
+    std::array<BlockPage *, 256> mapped_pages = {};
+    std::array<const u8 *, 256> mapped_srcs = {};
+
+    // Run hot ROM blocks as native code, off unless asked for
+    bool use_jit = false;
+    CodeBuffer jit_code;
+    std::uint64_t jit_limit = 0; // Native code leaves before reaching this
+    std::uint64_t jit_until = 0;
+    std::uint32_t jit_epoch = 0;
+    // End of the current run, HALT/STOP don't idle past it
+    std::uint64_t run_until = 0;
     
 };
 
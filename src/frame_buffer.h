@@ -0,0 +1,94 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include "types.h"
+
+namespace gb {
+
+// Triple buffer handing finished frames from the emulation thread to the
+// presenting one without locks. The producer always has a back buffer to
+// draw into, the consumer keeps the front one as long as it wants, and the
+// middle one holds the newest published frame. Frames the consumer doesn't
+// get to in time are overwritten, it only ever sees the newest.
+class FrameBuffer {
+public:
+    FrameBuffer(std::size_t pixels) {
+        for(auto& buffer : buffers) {
+            buffer.reset(new std::uint32_t[pixels]());
+        }
+    }
+
+    // Producer, the buffer to fill before publish
+    std::uint32_t *back() {
+        return buffers[back_index].get();
+    }
+
+    // Producer, makes back the newest frame and takes the middle one back
+    void publish() {
+        u8 old = middle.exchange(back_index | fresh, std::memory_order_acq_rel);
+        back_index = old & index_mask;
+    }
+
+    // Consumer, moves the newest frame to front. False when nothing was
+    // published since the last call and front is unchanged
+    bool acquire() {
+        if(!(middle.load(std::memory_order_relaxed) & fresh)) {
+            return false;
+        }
+        u8 old = middle.exchange(front_index, std::memory_order_acq_rel);
+        front_index = old & index_mask;
+        return true;
+    }
+
+    // Consumer, the last acquired frame
+    const std::uint32_t *front() const {
+        return buffers[front_index].get();
+    }
+
+private:
+    // Set in middle when it holds a frame the consumer hasn't taken
+    static constexpr u8 fresh = 0b100;
+    static constexpr u8 index_mask = 0b011;
+
+    std::array<std::unique_ptr<std::uint32_t[]>, 3> buffers;
+    u8 back_index = 0; // Producer only
+    u8 front_index = 1; // Consumer only
+    std::atomic<u8> middle = 2;
+};
+
+// Bounded single producer, single consumer queue. push fails when the
+// queue is full rather than waiting.
+template<typename T, std::size_t Size>
+class SpscQueue {
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+public:
+    bool push(const T& value) {
+        std::size_t tail = write.load(std::memory_order_relaxed);
+        if(tail - read.load(std::memory_order_acquire) == Size) {
+            return false;
+        }
+        slots[tail & (Size - 1)] = value;
+        write.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        std::size_t head = read.load(std::memory_order_relaxed);
+        if(head == write.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots[head & (Size - 1)];
+        read.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Size> slots = {};
+    // Apart so the two threads don't share a cache line
+    alignas(64) std::atomic<std::size_t> write = 0;
+    alignas(64) std::atomic<std::size_t> read = 0;
+};
+
+}
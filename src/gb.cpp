@@ -1,11 +1,22 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fmt/format.h>
 #include <SDL2/SDL.h>
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #include "cpu.h"
 #include "mmu.h"
+#include "frame_buffer.h"
+
+// Sent to the core thread when the keys change
+struct Input {
+    gb::u8 buttons = 0;
+    bool trace = false; // A dumps every instruction from then on
+};
 
 int main(int argc, char *argv[]) {
 
@@ -13,71 +24,135 @@ int main(int argc, char *argv[]) {
 
     mmu.load_bios("dmg_boot.bin");
     mmu.load_rom("mario.gb");
+    // GB_PALETTE=file swaps the greys for a colour scheme, see Palette
+    if(const char *palette = std::getenv("GB_PALETTE")) {
+        mmu.palette.load_scheme(palette);
+    }
 
     
 
     gb::CPU cpu(mmu);
+    // GB_JIT=1 runs hot ROM code natively
+    cpu.use_jit = std::getenv("GB_JIT") != nullptr;
+    // GB_FRAMESKIP=n only renders one frame in n
+    if(const char *frameskip = std::getenv("GB_FRAMESKIP")) {
+        cpu.gpu.frame_interval = std::strtoul(frameskip, nullptr, 10);
+    }
 
     SDL_Init(SDL_INIT_VIDEO);
 
     SDL_Window *window = nullptr;
     SDL_Renderer *renderer = nullptr;
 
-    if(SDL_CreateWindowAndRenderer(512, 512, 0, &window, &renderer) == -1) {
+    if(SDL_CreateWindowAndRenderer(gb::GPU::width * 3, gb::GPU::height * 3, 0, &window, &renderer) == -1) {
         fmt::print("{}\n", SDL_GetError());
     }
 
-    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 256, 256);
-
-    SDL_Event event;
-    Uint32 lastTick;
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, gb::GPU::width, gb::GPU::height);
+
+    // Presenting (and waiting for vsync) happens here while the core runs
+    // on its own thread. Finished frames come back through the triple
+    // buffer and button changes go the other way through the queue
+    gb::FrameBuffer frames(gb::GPU::width * gb::GPU::height);
+    gb::SpscQueue<Input, 64> inputs;
+    std::atomic<bool> running = true;
+
+    // Published as soon as the last line is drawn, the run below stops
+    // partway into the next frame whose writes would render over the top
+    cpu.gpu.on_frame = [&](const std::uint32_t *pixels) {
+        std::memcpy(frames.back(), pixels, gb::GPU::width * gb::GPU::height * 4);
+        frames.publish();
+    };
+
+    std::thread core([&] {
+        using clock = std::chrono::steady_clock;
+        // Run one LCD frame of cycles at a time, at the rate of the real thing
+        constexpr std::uint64_t frame_cycles = 70224;
+        constexpr auto frame_time = std::chrono::nanoseconds(1'000'000'000ull * frame_cycles / 4194304);
+
+        bool bp = false;
+        auto deadline = clock::now();
+
+        while(running.load(std::memory_order_relaxed)) {
+            Input input;
+            while(inputs.pop(input)) {
+                mmu.set_buttons(input.buttons);
+                bp |= input.trace;
+            }
 
-    lastTick = SDL_GetTicks();
-    bool bp = false;
+            auto end_cycles = cpu.cycles + frame_cycles;
 
+            if(bp) {
+                while(end_cycles > cpu.cycles) {
+                    cpu.dump_std();
+                    cpu.step();
+                }
+            } else {
+                cpu.run(end_cycles);
+            }
 
-    while (1) {
+            // Fell more than a frame behind (tracing, a stall), don't rush
+            // to make it up
+            deadline += frame_time;
+            auto now = clock::now();
+            if(now > deadline + frame_time) {
+                deadline = now;
+            } else {
+                std::this_thread::sleep_until(deadline);
+            }
+        }
+    });
 
+    SDL_Event event;
+    Input sent;
 
+    while (running) {
 
-        if (SDL_PollEvent(&event) && event.type == SDL_QUIT)
-            break;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT)
+                running = false;
+        }
 
         const Uint8 *state = SDL_GetKeyboardState(NULL);
-        if (state[SDL_SCANCODE_A]) {
-            
-            bp = true;
-        }
 
         if (state[SDL_SCANCODE_ESCAPE]) {
             
-            break;
+            running = false;
+        }
+
+        Input input;
+        if (state[SDL_SCANCODE_A]) input.trace = true;
+        if (state[SDL_SCANCODE_Z]) input.buttons |= gb::button_mask(gb::Button::A);
+        if (state[SDL_SCANCODE_X]) input.buttons |= gb::button_mask(gb::Button::B);
+        if (state[SDL_SCANCODE_BACKSPACE]) input.buttons |= gb::button_mask(gb::Button::Select);
+        if (state[SDL_SCANCODE_RETURN]) input.buttons |= gb::button_mask(gb::Button::Start);
+        if (state[SDL_SCANCODE_RIGHT]) input.buttons |= gb::button_mask(gb::Button::Right);
+        if (state[SDL_SCANCODE_LEFT]) input.buttons |= gb::button_mask(gb::Button::Left);
+        if (state[SDL_SCANCODE_UP]) input.buttons |= gb::button_mask(gb::Button::Up);
+        if (state[SDL_SCANCODE_DOWN]) input.buttons |= gb::button_mask(gb::Button::Down);
+
+        // Only changes are sent, a full queue is retried on the next poll
+        if ((input.buttons != sent.buttons || input.trace != sent.trace) && inputs.push(input)) {
+            sent = input;
+        }
+
+        if (!frames.acquire()) {
+            SDL_Delay(1);
+            continue;
         }
 
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
         SDL_RenderClear(renderer);
         
-        SDL_UpdateTexture(texture, NULL, cpu.gpu.frame.get(), 256 * 4);
+        SDL_UpdateTexture(texture, NULL, frames.front(), gb::GPU::width * 4);
 
         SDL_RenderCopy(renderer, texture, NULL, NULL);
         
         SDL_RenderPresent(renderer);
-
-        Uint32 elapsed = SDL_GetTicks() - lastTick;
-        lastTick = SDL_GetTicks();
-
-        uint32_t cycles = 4194304.0f * elapsed / 1000.0f;
-
-        auto end_cycles = cpu.cycles + cycles;
-
-        while(end_cycles > cpu.cycles) {
-            if(bp) {
-                cpu.dump_std();
-            }
-            cpu.step();
-        }
     }
 
+    core.join();
+
 
     /*while(true) {
         mmu.io.JOYP = 0b0000111;
@@ -1,33 +1,51 @@
+#include <algorithm>
+#include <cstring>
 #include <vector>
 #include <fmt/format.h>
 #include "gpu.h"
 
 namespace gb {
 
-GPU::GPU(MMU& mmu) : dots(0), mmu(mmu), frame(new uint32_t[256 * 256]) {
-
+GPU::GPU(MMU& mmu) : mmu(mmu), frame(new uint32_t[width * height]()) {
+    mmu.gpu = this;
 }
 
-void GPU::step(u16 cycles) {
-    dots += cycles;
+GPU::~GPU() {
+    if(mmu.gpu == this) {
+        mmu.gpu = nullptr;
+    }
+}
 
-    if(dots > 456) {
-        dots = 0;
-        draw_line(mmu.io.LY);
-        mmu.io.LY += 1;
+void GPU::catch_up() {
+    if(rendered_frame != mmu.lcd.frame_count()) {
+        rendered_frame = mmu.lcd.frame_count();
+        rendered = 0;
 
-        if(mmu.io.LY == 143) {
-            mmu.io.IF |= 1;
+        // Decided per frame so a frame is never partly rendered
+        skipped++;
+        drawing_frame = render && skipped >= frame_interval;
+        if(drawing_frame) {
+            skipped = 0;
         }
-
     }
 
-    if(mmu.io.LY > 153) {
-        mmu.io.LY = 0;
+    if(!drawing_frame) {
+        return;
     }
 
-    //mmu.io.LY = 0x90;
-
+    u8 ready = mmu.lcd.lines_ready();
+    if(rendered >= ready) {
+        return;
+    }
+    for(; rendered < ready; rendered++) {
+        draw_line(rendered);
+    }
+    if(rendered == height) {
+        frames_drawn++;
+        if(on_frame) {
+            on_frame(frame.get());
+        }
+    }
 }
 
 u8 GPU::get_tile(u8 x, u8 y) {
@@ -38,103 +56,154 @@ u8 GPU::get_tile(u8 x, u8 y) {
 }
 
 u8 GPU::get_color(u8 tile, u8 x, u8 y, bool bg) {
+    return tile_row(tile, y, bg)[x];
+}
 
-    u8 mask = 1 << (7 - x);
-
-    u16 base = 0x8000;
+const u8 *GPU::tile_row(u8 tile, u8 y, bool bg) {
+    u16 index = tile;
 
-    if(bg && (mmu.io.LCDC & 0b0001'0000) == 0) {
-        if(tile <= 127) {
-            base = 0x9000;
-        } else {
-            base = 0x8800;
-        }
+    // With LCDC bit 4 clear tiles 0-127 come from 0x9000 and 128-255 from 0x8800
+    if(bg && (mmu.io.LCDC & 0b0001'0000) == 0 && tile <= 127) {
+        index += 256;
     }
 
-    u16 addr = base + tile * 16 + y * 2;
+    return mmu.tiles.row(index, y);
+}
 
-    u8 plane1 = mmu[addr];
-    u8 plane2 = mmu[addr + 1];
+void GPU::draw_line(u8 y) {
 
-    u8 bit1 = (plane1 & mask) == mask;
-    u8 bit2 = (plane2 & mask) == mask;
+    if(y == 0) {
+        window_line = 0;
+    }
 
+    const u8 *bg = background_line(y);
+    draw_sprites(y, bg);
+
+    compose(bg, obj_line.data(), mmu.palette.line(), &frame[y * width], width);
 
-    return (bit2 << 1) | bit1;
 }
 
-std::uint32_t GPU::palletize(u8 palette, u8 color) {
-    std::array<std::uint32_t, 4> colors = { 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000 };
-    //std::array<std::uint32_t, 4> colors = { 0xFF000000, 0xFF555555, 0xFFAAAAAA, 0xFFFFFFFF };
+const u8 *GPU::background_line(u8 y) {
+    u8 lcdc = mmu.io.LCDC;
 
-    std::array<u8, 4> conversion{u8(palette& 0x03), u8((palette >> 2) & 0x03), u8((palette >> 4) & 0x03), u8((palette >> 6) & 0x03)};
+    if((lcdc & 0b0000'0001) == 0) {
+        bg_line.fill(LinePalette::blank);
+        return bg_line.data();
+    }
 
-    return colors[conversion[color]];
+    bool signed_tiles = (lcdc & 0b0001'0000) == 0;
+    u8 bg_y = (y + mmu.io.SCY) % 256;
 
-}
+    // Only the cells this line crosses have to be current
+    bool high_map = lcdc & 0b0000'1000;
+    BackgroundPlane& plane = planes[high_map];
+    u8 cells = (mmu.io.SCX % 8 + width + 7) / 8;
+    plane.update(mmu.tile_map(high_map), bg_y / 8, mmu.io.SCX / 8, cells, mmu.tiles, signed_tiles);
 
-void GPU::draw_line(u8 y) {
+    const u8 *line = plane.line(bg_y) + mmu.io.SCX;
 
-    u8 py = y;
+    if((lcdc & 0b0010'0000) == 0 || y < mmu.io.WY || mmu.io.WX > 166) {
+        return line;
+    }
 
-    for(u16 px = 0; px <= 255; px++) {
+    // The window covers everything right of WX - 7. With WX below 7 its
+    // first columns are off screen
+    int left = mmu.io.WX - 7;
+    std::size_t start = std::max(left, 0);
+    std::size_t skip = start - left;
+    std::size_t visible = width - start;
 
-        u8 y = (py + mmu.io.SCY) % 256;
-        u8 x = (px + mmu.io.SCX) % 256;
+    bool window_map = lcdc & 0b0100'0000;
+    BackgroundPlane& window = planes[window_map];
+    u8 first = skip / 8;
+    u8 last = (skip + visible - 1) / 8;
+    window.update(mmu.tile_map(window_map), window_line / 8, first, last - first + 1, mmu.tiles, signed_tiles);
 
-        u8 tile = get_tile(x, y);
+    std::memcpy(bg_line.data(), line, start);
+    std::memcpy(bg_line.data() + start, window.line(window_line) + skip, visible);
+    window_line++;
 
-        u8 color = get_color(tile, x % 8, y % 8, true);
-        uint32_t pixel = palletize(mmu.io.BGP, color);
+    return bg_line.data();
+}
 
-        frame[px + py * 256] = pixel;
-    }
+void GPU::evaluate_sprites() {
+    u8 size = mmu.io.LCDC & 0b0000'0100 ? 16 : 8;
 
-    std::array<OAM *, 10> sprites = {};
-    std::size_t numSprites = 0;
+    for(SpriteList& list : sprite_lists) {
+        list.count = 0;
+    }
 
-    for(int i = 0; i < mmu.oam.size(); i++) {
-        if(mmu.io.LY >= mmu.oam[i].y - 16 && mmu.io.LY <= mmu.oam[i].y + 7 - 16) {
-            sprites[numSprites++] = &mmu.oam[i];
+    // The first 10 sprites in OAM order that cover a line are the ones shown
+    for(u8 i = 0; i < mmu.oam.size(); i++) {
+        int top = mmu.oam[i].y - 16;
+        int bottom = std::min<int>(top + size, height);
+        for(int line = std::max(top, 0); line < bottom; line++) {
+            SpriteList& list = sprite_lists[line];
+            if(list.count < list.sprites.size()) {
+                list.sprites[list.count++] = i;
+            }
         }
+    }
 
-        if(numSprites == 10) {
-            break;
-        }
+    // Lower x wins, then lower OAM index
+    for(SpriteList& list : sprite_lists) {
+        std::stable_sort(list.sprites.begin(), list.sprites.begin() + list.count, [this](u8 lhs, u8 rhs) {
+            return mmu.oam[lhs].x < mmu.oam[rhs].x;
+        });
     }
 
-    for(u16 x = 0; x < 255; x++) {
+    sprites_version = mmu.oam_version;
+    sprites_height = size;
+}
 
-        OAM *sprite = nullptr;
-        for(std::size_t i = 0; i < numSprites; i++) {
-            if(x >= sprites[i]->x - 8 && x < sprites[i]->x) {
-                sprite = sprites[i];
-            }
-        }
+void GPU::draw_sprites(u8 y, const u8 *bg) {
+    obj_line.fill(0);
 
-        if(sprite) {
-            u8 palette = sprite->palette == 0 ? mmu.io.OBP0 : mmu.io.OBP1;
+    if((mmu.io.LCDC & 0b0000'0010) == 0) {
+        return;
+    }
 
-            u8 sprite_x = 8 - (sprite->x - x);
-            u8 sprite_y = 16 - (sprite->y - mmu.io.LY);
+    u8 size = mmu.io.LCDC & 0b0000'0100 ? 16 : 8;
+    if(sprites_version != mmu.oam_version || sprites_height != size) {
+        evaluate_sprites();
+    }
 
-            if(sprite->xflip) {
-                sprite_x = 7 - sprite_x;
+    // Lowest priority first so higher ones are drawn over them
+    const SpriteList& list = sprite_lists[y];
+    for(int i = list.count - 1; i >= 0; i--) {
+        const OAM& sprite = mmu.oam[list.sprites[i]];
+        u8 base = sprite.palette == 0 ? 4 : 8;
+
+        u8 sprite_y = y + 16 - sprite.y;
+        if(sprite.yflip) {
+            sprite_y = size - 1 - sprite_y;
+        }
+
+        // 8x16 sprites are an even tile and the one after it
+        u8 tile = size == 16 ? (sprite.tile & 0xFE) + sprite_y / 8 : sprite.tile;
+        const u8 *row = tile_row(tile, sprite_y % 8, false);
+
+        for(u8 sprite_x = 0; sprite_x < 8; sprite_x++) {
+            int x = sprite.x - 8 + sprite_x;
+            if(x < 0 || x >= int(width)) {
+                continue;
             }
 
-            if(sprite->yflip) {
-                sprite_y = 7 - sprite_y;
+            u8 color = row[sprite.xflip ? 7 - sprite_x : sprite_x];
+            if(color == 0) {
+                continue;
             }
 
-            u8 color = get_color(sprite->tile, sprite_x, sprite_y, false);
-            if(color != 0) {
-                uint32_t pixel = palletize(palette, color);
-                frame[x + y * 256] = pixel;
+            // A sprite behind the background only shows over colour 0,
+            // and still hides the sprites under it
+            if(sprite.priority && bg[x] >= 1 && bg[x] <= 3) {
+                obj_line[x] = 0;
+            } else {
+                obj_line[x] = base + color;
             }
         }
     }
-
 }
 
 
-}
\ No newline at end of file
+}
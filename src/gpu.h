@@ -1,25 +1,89 @@
 #pragma once
+#include <functional>
 #include "types.h"
 #include "mmu.h"
+#include "compositor.h"
+#include "background.h"
 
 namespace gb {
 
 class GPU {
     public:
     GPU(MMU& mmu);
+    ~GPU();
 
-    void step(u16 cycles);
+    // mmu.gpu points back here
+    GPU(const GPU&) = delete;
+    GPU& operator=(const GPU&) = delete;
+
+    // Renders the lines the LCD has finished since the last call, with the
+    // registers and memory as they are now
+    void catch_up();
+
+    // Frameskip, one frame in every frame_interval is rendered and the rest
+    // leave frame as it was. 0 and 1 render every frame
+    unsigned frame_interval = 1;
+    // Clear to keep the LCD timing (LY, STAT, interrupts) without generating
+    // any pixels. Both are read when a frame starts
+    bool render = true;
+    // Whether the current frame is being rendered
+    bool drawing_frame = true;
+    // Bumped when the last line of a frame has been rendered
+    std::uint32_t frames_drawn = 0;
+    // Called with frame right after its last line is rendered, before
+    // anything from the next frame can be drawn into it
+    std::function<void(const std::uint32_t *)> on_frame;
 
     u8 get_tile(u8 x, u8 y);
     void draw_line(u8 line);
     u8 get_color(u8 tile, u8 x, u8 y, bool bg);
-    std::uint32_t palletize(u8 palette, u8 color);
+    // Decoded pixels of row y of a tile, bg picks the tile data LCDC selects
+    const u8 *tile_row(u8 tile, u8 y, bool bg);
+
+    // Background with the window over it, width colour indexes
+    const u8 *background_line(u8 y);
+    // Fills obj_line, hiding sprite pixels that are behind bg
+    void draw_sprites(u8 y, const u8 *bg);
+    // Rebuilds sprite_lists from OAM
+    void evaluate_sprites();
 
 
+    static constexpr std::size_t width = 160;
+    static constexpr std::size_t height = 144;
+
     //private:
-    u16 dots;
     MMU& mmu;
+    // The visible screen, width * height ARGB pixels
     std::unique_ptr<uint32_t[]> frame;
+
+    Compositor compose = select_compositor();
+    // Tile maps at 0x9800 and 0x9C00, the background is a scrolled view of one
+    std::array<BackgroundPlane, 2> planes;
+    // Lines drawn with the window so far this frame, the window's own LY
+    u8 window_line = 0;
+    // Background line when the window or LCDC bit 0 means it isn't a plain
+    // view of a plane
+    std::array<u8, width> bg_line = {};
+
+    // Up to 10 OAM indexes per line, highest priority (lowest x) first
+    struct SpriteList {
+        u8 count = 0;
+        std::array<u8, 10> sprites = {};
+    };
+
+    // Rebuilt when OAM or the sprite size changes, not every line
+    std::array<SpriteList, height> sprite_lists;
+    std::uint32_t sprites_version = 0;
+    u8 sprites_height = 0; // 0 until the first evaluation
+
+    // Sprite layer of the line being drawn
+    std::array<u8, width> obj_line = {};
+
+    // Lines of frame rendered_frame that are in frame already
+    u8 rendered = 0;
+    std::uint32_t rendered_frame = 0;
+    // Frames since the last rendered one
+    unsigned skipped = 0;
 };
 
 
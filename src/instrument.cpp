@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fmt/format.h>
+#include "instrument.h"
+
+namespace gb {
+
+CountingPolicy::CountingPolicy() : histogram(new Count[0x10000]()) {
+
+}
+
+CountingPolicy::~CountingPolicy() {
+    static const char *names[NumRegions] = {
+        "ROM0", "ROMX", "VRAM", "SRAM", "WRAM", "ECHO", "OAM", "UNUSABLE", "IO", "HRAM", "IE"
+    };
+
+    fmt::print("{:<10} {:>16} {:>16}\n", "Region", "Reads", "Writes");
+    for(int i = 0; i < NumRegions; i++) {
+        fmt::print("{:<10} {:>16} {:>16}\n", names[i], reads[i], writes[i]);
+    }
+
+    std::FILE *file = std::fopen("memory_heat.csv", "w");
+    if(!file) {
+        fmt::print("Unable to write memory_heat.csv\n");
+        return;
+    }
+
+    fmt::print(file, "addr,reads,writes\n");
+    for(std::uint32_t addr = 0; addr < 0x10000; addr++) {
+        if(histogram[addr].reads || histogram[addr].writes) {
+            fmt::print(file, "{:04X},{},{}\n", addr, histogram[addr].reads, histogram[addr].writes);
+        }
+    }
+    std::fclose(file);
+}
+
+CountingPolicy::Region CountingPolicy::region(u16 addr) {
+    if(addr <= 0x3FFF) {
+        return ROM0;
+    } else if(addr <= 0x7FFF) {
+        return ROMX;
+    } else if(addr <= 0x9FFF) {
+        return VRAM;
+    } else if(addr <= 0xBFFF) {
+        return SRAM;
+    } else if(addr <= 0xDFFF) {
+        return WRAM;
+    } else if(addr <= 0xFDFF) {
+        return ECHO;
+    } else if(addr <= 0xFE9F) {
+        return OAM;
+    } else if(addr <= 0xFEFF) {
+        return UNUSABLE;
+    } else if(addr <= 0xFF7F) {
+        return IO;
+    } else if(addr <= 0xFFFE) {
+        return HRAM;
+    }
+    return IE;
+}
+
+WatchpointPolicy::WatchpointPolicy() {
+    const char *env = std::getenv("GB_WATCH");
+    if(!env) {
+        return;
+    }
+
+    std::string list{env};
+    std::size_t pos = 0;
+    while(pos < list.size()) {
+        std::size_t end = list.find(',', pos);
+        if(end == std::string::npos) {
+            end = list.size();
+        }
+        std::string word = list.substr(pos, end - pos);
+        char *parsed = nullptr;
+        unsigned long addr = std::strtoul(word.c_str(), &parsed, 16);
+        if(word.empty() || *parsed != '\0' || addr > 0xFFFF) {
+            fmt::print("Bad address {} in GB_WATCH\n", word);
+        } else {
+            watch(addr);
+        }
+        pos = end + 1;
+    }
+}
+
+void WatchpointPolicy::hit(u16 pc, u16 addr, u8 value, bool write) {
+    fmt::print("Watch {:04X}: {} {:02X} at PC {:04X}\n", addr, write ? "write" : "read", value, pc);
+}
+
+}
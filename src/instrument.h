@@ -0,0 +1,101 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <memory>
+#include "types.h"
+
+namespace gb {
+
+// Memory access instrumentation for CPU::read8/write8. The policy is picked
+// at compile time (see GB_MEMORY_COUNTING/GB_MEMORY_WATCHPOINTS in
+// CMakeLists.txt) so the default NullPolicy costs nothing.
+
+class NullPolicy {
+public:
+    void read(u16, u16, u8) { }
+    void write(u16, u16, u8) { }
+};
+
+class CountingPolicy {
+public:
+    enum Region {
+        ROM0,
+        ROMX,
+        VRAM,
+        SRAM,
+        WRAM,
+        ECHO,
+        OAM,
+        UNUSABLE,
+        IO,
+        HRAM,
+        IE,
+        NumRegions
+    };
+
+    CountingPolicy();
+    // Prints the per region counters and writes the histogram to memory_heat.csv
+    ~CountingPolicy();
+
+    void read(u16, u16 addr, u8) {
+        reads[region(addr)]++;
+        histogram[addr].reads++;
+    }
+
+    void write(u16, u16 addr, u8) {
+        writes[region(addr)]++;
+        histogram[addr].writes++;
+    }
+
+    static Region region(u16 addr);
+
+private:
+    struct Count {
+        std::uint64_t reads;
+        std::uint64_t writes;
+    };
+
+    std::array<std::uint64_t, NumRegions> reads = {};
+    std::array<std::uint64_t, NumRegions> writes = {};
+    std::unique_ptr<Count[]> histogram;
+};
+
+class WatchpointPolicy : public CountingPolicy {
+public:
+    // Watched addresses are read from GB_WATCH as comma separated hex, e.g.
+    // GB_WATCH=FF46,C000
+    WatchpointPolicy();
+
+    void read(u16 pc, u16 addr, u8 value) {
+        CountingPolicy::read(pc, addr, value);
+        if(watched[addr]) {
+            hit(pc, addr, value, false);
+        }
+    }
+
+    void write(u16 pc, u16 addr, u8 value) {
+        CountingPolicy::write(pc, addr, value);
+        if(watched[addr]) {
+            hit(pc, addr, value, true);
+        }
+    }
+
+    void watch(u16 addr) {
+        watched[addr] = true;
+    }
+
+private:
+    void hit(u16 pc, u16 addr, u8 value, bool write);
+
+    std::bitset<0x10000> watched;
+};
+
+#if defined(GB_MEMORY_WATCHPOINTS)
+using MemoryPolicy = WatchpointPolicy;
+#elif defined(GB_MEMORY_COUNTING)
+using MemoryPolicy = CountingPolicy;
+#else
+using MemoryPolicy = NullPolicy;
+#endif
+
+}
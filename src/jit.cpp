@@ -0,0 +1,873 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <type_traits>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "cpu.h"
+
+namespace gb {
+
+// Runs before a ROM block is worth compiling
+constexpr std::uint32_t jit_threshold = 32;
+
+CodeBuffer::~CodeBuffer() {
+    if(memory) {
+        munmap(memory, size);
+    }
+}
+
+const u8 *CodeBuffer::add(const std::vector<u8>& code) {
+    if(!memory && !failed) {
+        // Mapped without exec, pages are only ever writable or executable
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapped == MAP_FAILED) {
+            fmt::print("Unable to map JIT memory: {}\n", std::strerror(errno));
+            failed = true;
+        } else {
+            memory = static_cast<u8 *>(mapped);
+        }
+    }
+
+    if(!memory || used + code.size() > size) {
+        return nullptr;
+    }
+
+    // The last page can already hold code, so it goes back to RW while
+    // this is appended and everything touched is made RX again after
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    std::size_t begin = used / page * page;
+    std::size_t end = (used + code.size() + page - 1) / page * page;
+
+    if(mprotect(memory + begin, end - begin, PROT_READ | PROT_WRITE) != 0) {
+        fmt::print("Unable to write JIT memory: {}\n", std::strerror(errno));
+        return nullptr;
+    }
+
+    u8 *dest = memory + used;
+    std::memcpy(dest, code.data(), code.size());
+
+    if(mprotect(memory + begin, end - begin, PROT_READ | PROT_EXEC) != 0) {
+        fmt::print("Unable to make JIT memory executable: {}\n", std::strerror(errno));
+        // Kernels that refuse exec do so on the first block, before any
+        // code is in the buffer, nothing more is added from then on
+        used = size;
+        return nullptr;
+    }
+
+    used += code.size();
+    return dest;
+}
+
+bool CPU::run_native(Block& block, std::uint64_t until) {
+    if(!block.native) {
+        // RAM code can change under us, only ROM is compiled
+        if(pc >= 0x8000 || ++block.hits != jit_threshold) {
+            return false;
+        }
+        block.native = compile_block(block, pc);
+        if(!block.native) {
+            return false;
+        }
+        block.native_addr = pc;
+    } else if(block.native_addr != pc) {
+        return false;
+    }
+
+    if(check_int()) {
+        (this->*op_table[fetch8()])();
+        return true;
+    }
+
+    jit_until = until;
+    jit_limit = std::min(mmu.scheduler.next, until);
+    jit_epoch = mmu.code_epoch;
+
+    std::uint64_t start = cycles;
+    block.native(this);
+    // Nothing ran if the first op would have reached an event
+    return cycles != start;
+}
+
+// Called from native code for anything it doesn't handle itself, with the
+// registers and pc stored back. Does what run_block does for one op and
+// returns true when the native code has to leave before the next one
+bool CPU::native_step(CPU *cpu, const MicroOp *uop) {
+    if(cpu->cycles >= cpu->jit_until) {
+        return true;
+    }
+
+    cpu->pc += uop->length;
+    cpu->cycles += uop->cycles;
+    if(cpu->cycles >= cpu->mmu.scheduler.next) {
+        cpu->service_events();
+    }
+
+    (cpu->*uop->handler)(*uop);
+
+    cpu->jit_limit = std::min(cpu->mmu.scheduler.next, cpu->jit_until);
+    return (cpu->ime && (cpu->mmu.IE & cpu->mmu.io.IF)) || cpu->mmu.code_epoch != cpu->jit_epoch || cpu->mmu.dma_active;
+}
+
+#if defined(__x86_64__)
+
+namespace {
+
+// Host registers, numbered as in the instruction encoding
+enum Reg : u8 {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Where the SM83 registers are pinned, indexed like get_reg. (HL) has no
+// register of its own
+constexpr std::array<Reg, 8> pinned = { R9, R10, R11, R12, R13, R14, RAX, R8 };
+
+enum Operand : u8 {
+    RegB, RegC, RegD, RegE, RegH, RegL, RegHL, RegA
+};
+
+// Just enough of an x86-64 assembler for compile_block. Memory operands
+// are [base + disp32] or [base + index * scale], base can't be rsp/rbp/r12/r13
+class Emitter {
+public:
+    std::vector<u8> code;
+
+    void byte(u8 value) {
+        code.push_back(value);
+    }
+
+    void imm16(u16 value) {
+        byte(value);
+        byte(value >> 8);
+    }
+
+    void imm32(std::uint32_t value) {
+        for(int i = 0; i < 32; i += 8) {
+            byte(value >> i);
+        }
+    }
+
+    void imm64(std::uint64_t value) {
+        for(int i = 0; i < 64; i += 8) {
+            byte(value >> i);
+        }
+    }
+
+    void rex(bool wide, u8 reg, u8 rm, u8 index = 0, bool force = false) {
+        u8 prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | rm >> 3;
+        if(prefix != 0x40 || force) {
+            byte(prefix);
+        }
+    }
+
+    void direct(u8 reg, u8 rm) {
+        byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void mem(u8 reg, Reg base, std::int32_t disp) {
+        byte(0x80 | (reg & 7) << 3 | (base & 7));
+        imm32(disp);
+    }
+
+    void indexed(u8 reg, Reg base, Reg index, u8 scale) {
+        byte(0x04 | (reg & 7) << 3);
+        byte(scale << 6 | (index & 7) << 3 | (base & 7));
+    }
+
+    void mov(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x89);
+        direct(src, dst);
+    }
+
+    void mov64(Reg dst, Reg src) {
+        rex(true, src, dst);
+        byte(0x89);
+        direct(src, dst);
+    }
+
+    void mov(Reg dst, std::uint32_t value) {
+        rex(false, 0, dst);
+        byte(0xB8 | (dst & 7));
+        imm32(value);
+    }
+
+    void mov64(Reg dst, std::uint64_t value) {
+        rex(true, 0, dst);
+        byte(0xB8 | (dst & 7));
+        imm64(value);
+    }
+
+    void load8(Reg dst, Reg base, std::int32_t disp) {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB6);
+        mem(dst, base, disp);
+    }
+
+    void store8(Reg base, std::int32_t disp, Reg src) {
+        rex(false, src, base, 0, true);
+        byte(0x88);
+        mem(src, base, disp);
+    }
+
+    void load16(Reg dst, Reg base, std::int32_t disp) {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB7);
+        mem(dst, base, disp);
+    }
+
+    void store16(Reg base, std::int32_t disp, Reg src) {
+        byte(0x66);
+        rex(false, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+
+    void store16(Reg base, std::int32_t disp, u16 value) {
+        byte(0x66);
+        rex(false, 0, base);
+        byte(0xC7);
+        mem(0, base, disp);
+        imm16(value);
+    }
+
+    void load64(Reg dst, Reg base, std::int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8B);
+        mem(dst, base, disp);
+    }
+
+    // dst = [base + index * 8]
+    void load64(Reg dst, Reg base, Reg index) {
+        rex(true, dst, base, index);
+        byte(0x8B);
+        indexed(dst, base, index, 3);
+    }
+
+    // dst = zero extended byte [base + index]
+    void load8(Reg dst, Reg base, Reg index) {
+        rex(false, dst, base, index);
+        byte(0x0F);
+        byte(0xB6);
+        indexed(dst, base, index, 0);
+    }
+
+    // byte [base + index] = src
+    void store8(Reg base, Reg index, Reg src) {
+        rex(false, src, base, index, true);
+        byte(0x88);
+        indexed(src, base, index, 0);
+    }
+
+    void store8(Reg base, Reg index, u8 value) {
+        rex(false, 0, base, index);
+        byte(0xC6);
+        indexed(0, base, index, 0);
+        byte(value);
+    }
+
+    void add(Reg dst, std::int32_t value) {
+        rex(false, 0, dst);
+        byte(0x81);
+        direct(0, dst);
+        imm32(value);
+    }
+
+    void add64(Reg dst, std::int32_t value) {
+        rex(true, 0, dst);
+        byte(0x81);
+        direct(0, dst);
+        imm32(value);
+    }
+
+    void add64(Reg base, std::int32_t disp, std::int32_t value) {
+        rex(true, 0, base);
+        byte(0x81);
+        mem(0, base, disp);
+        imm32(value);
+    }
+
+    void and_(Reg dst, std::uint32_t value) {
+        rex(false, 0, dst);
+        byte(0x81);
+        direct(4, dst);
+        imm32(value);
+    }
+
+    void or_(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x09);
+        direct(src, dst);
+    }
+
+    void and_(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x21);
+        direct(src, dst);
+    }
+
+    void xor_(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x31);
+        direct(src, dst);
+    }
+
+    void xor_(Reg dst, std::uint32_t value) {
+        rex(false, 0, dst);
+        byte(0x81);
+        direct(6, dst);
+        imm32(value);
+    }
+
+    void add(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x01);
+        direct(src, dst);
+    }
+
+    void sub(Reg dst, Reg src) {
+        rex(false, src, dst);
+        byte(0x29);
+        direct(src, dst);
+    }
+
+    void store8(Reg base, std::int32_t disp, u8 value) {
+        rex(false, 0, base);
+        byte(0xC6);
+        mem(0, base, disp);
+        byte(value);
+    }
+
+    void shl(Reg dst, u8 count) {
+        rex(false, 0, dst);
+        byte(0xC1);
+        direct(4, dst);
+        byte(count);
+    }
+
+    void shr(Reg dst, u8 count) {
+        rex(false, 0, dst);
+        byte(0xC1);
+        direct(5, dst);
+        byte(count);
+    }
+
+    void cmp64(Reg reg, Reg base, std::int32_t disp) {
+        rex(true, reg, base);
+        byte(0x3B);
+        mem(reg, base, disp);
+    }
+
+    void cmp8(Reg base, std::int32_t disp, u8 value) {
+        rex(false, 0, base);
+        byte(0x80);
+        mem(7, base, disp);
+        byte(value);
+    }
+
+    void test64(Reg lhs, Reg rhs) {
+        rex(true, rhs, lhs);
+        byte(0x85);
+        direct(rhs, lhs);
+    }
+
+    void test8(Reg lhs, Reg rhs) {
+        rex(false, rhs, lhs, 0, lhs >= RSP || rhs >= RSP);
+        byte(0x84);
+        direct(rhs, lhs);
+    }
+
+    void push(Reg reg) {
+        rex(false, 0, reg);
+        byte(0x50 | (reg & 7));
+    }
+
+    void pop(Reg reg) {
+        rex(false, 0, reg);
+        byte(0x58 | (reg & 7));
+    }
+
+    void call(Reg reg) {
+        rex(false, 0, reg);
+        byte(0xFF);
+        direct(2, reg);
+    }
+
+    void ret() {
+        byte(0xC3);
+    }
+
+    // Conditional jump to a label that isn't known yet, returns what to patch
+    std::size_t jump(u8 condition) {
+        byte(0x0F);
+        byte(0x80 | condition);
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    std::size_t jump() {
+        byte(0xE9);
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    void patch(std::size_t at, std::size_t target) {
+        std::int32_t rel = target - (at + 4);
+        std::memcpy(&code[at], &rel, 4);
+    }
+
+    static constexpr u8 below = 0x2, above_equal = 0x3, zero = 0x4, not_zero = 0x5;
+};
+
+// Loads and stores are done natively only when nothing is watching memory
+constexpr bool native_memory = std::is_same_v<MemoryPolicy, NullPolicy>;
+
+// ADD, SUB, AND, XOR, OR and CP, by bits 3-5 of the opcode. ADC/SBC need
+// the carry and are left to the interpreter
+bool native_alu(u8 group) {
+    return group == 0 || group == 2 || group >= 4;
+}
+
+bool reads_memory(u8 op) {
+    switch(op) {
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A: case 0xFA:
+            return true;
+        default:
+            if(op >= 0x80 && op < 0xC0) {
+                return (op & 7) == RegHL && native_alu((op >> 3) & 7);
+            }
+            return op >= 0x40 && op < 0x80 && op != 0x76 && (op & 7) == RegHL;
+    }
+}
+
+bool writes_memory(u8 op) {
+    switch(op) {
+        case 0x02: case 0x12: case 0x22: case 0x32: case 0x36: case 0xEA:
+            return true;
+        default:
+            return op >= 0x70 && op < 0x78 && op != 0x76;
+    }
+}
+
+// JR and JP, always the last op of a block
+bool jumps(u8 op) {
+    switch(op) {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Cycles taken by an op compile_block handles natively, at most when that
+// depends on a branch. 0 if it doesn't handle it
+std::uint32_t native_cycles(u8 op, const CPU::MicroOp& uop) {
+    if(reads_memory(op) || writes_memory(op)) {
+        return native_memory ? uop.cycles + 4 : 0;
+    }
+
+    if(jumps(op)) {
+        // JR -6 is left to op_jr, it may be an idle loop
+        return op < 0x40 && i8(uop.imm) == -6 ? 0 : uop.cycles + 4;
+    }
+
+    switch(op) {
+        case 0x00: case 0x2F: case 0x37:
+        case 0x01: case 0x11: case 0x21: case 0x31:
+        case 0x03: case 0x13: case 0x23: case 0x33:
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+        case 0xC6: case 0xD6: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            return uop.cycles;
+        default:
+            if(op >= 0x80 && op < 0xC0) {
+                return native_alu((op >> 3) & 7) ? uop.cycles : 0;
+            }
+            return op >= 0x40 && op < 0x80 && op != 0x76 ? uop.cycles : 0;
+    }
+}
+
+}
+
+// Translates a ROM block into x86-64. rbx holds the CPU and rbp the cycle
+// counter. SM83 registers are pinned in host registers, loaded on first use
+// and only stored back when changed. Runs of ops that are handled natively
+// check once that they can't reach jit_limit, anything else is passed to
+// native_step with the registers stored back
+CPU::NativeBlock CPU::compile_block(const Block& block, u16 addr) {
+    const u8 *page = mmu.read_page(addr);
+
+    std::vector<u8> ops;
+    std::vector<std::uint32_t> costs;
+    u16 at = addr;
+    for(const MicroOp& uop : block.ops) {
+        ops.push_back(page[at & 0xFF]);
+        costs.push_back(native_cycles(ops.back(), uop));
+        at += uop.length;
+    }
+
+    if(std::none_of(costs.begin(), costs.end(), [](std::uint32_t cost) { return cost != 0; })) {
+        // Nothing to gain over run_block
+        return nullptr;
+    }
+
+    auto offset = [this](const void *member) {
+        return std::int32_t(static_cast<const char *>(member) - reinterpret_cast<const char *>(this));
+    };
+    const std::array<std::int32_t, 8> reg_offsets = {
+        offset(&b), offset(&c), offset(&d), offset(&e), offset(&h), offset(&l), 0, offset(&a)
+    };
+
+    Emitter out;
+
+    u8 loaded = 0; // Pinned registers holding their current value
+    u8 dirty = 0; // Pinned registers changed since they were loaded
+    std::uint32_t pending = 0; // Cycles not yet added to the counter
+
+    auto use = [&](u8 z) {
+        if(!(loaded & 1 << z)) {
+            out.load8(pinned[z], RBX, reg_offsets[z]);
+            loaded |= 1 << z;
+        }
+        return pinned[z];
+    };
+    auto def = [&](u8 z) {
+        loaded |= 1 << z;
+        dirty |= 1 << z;
+        return pinned[z];
+    };
+    auto spill = [&](u8 regs) {
+        for(u8 z : { RegB, RegC, RegD, RegE, RegH, RegL, RegA }) {
+            if(regs & 1 << z) {
+                out.store8(RBX, reg_offsets[z], pinned[z]);
+            }
+        }
+    };
+    auto flush_cycles = [&] {
+        if(pending) {
+            out.add64(RBP, 0, pending);
+            pending = 0;
+        }
+    };
+
+    // eax = hi << 8 | lo
+    auto pair = [&](u8 hi, u8 lo) {
+        out.mov(RAX, use(hi));
+        out.shl(RAX, 8);
+        out.or_(RAX, use(lo));
+    };
+    // hi, lo = eax
+    auto split = [&](u8 hi, u8 lo) {
+        out.and_(RAX, 0xFFFF);
+        out.mov(def(lo), RAX);
+        out.and_(pinned[lo], 0xFF);
+        out.shr(RAX, 8);
+        out.mov(def(hi), RAX);
+    };
+    auto step_pair = [&](u8 hi, u8 lo, std::int32_t delta) {
+        pair(hi, lo);
+        out.add(RAX, delta);
+        split(hi, lo);
+    };
+
+    // Flags are stored straight into f in the same form the ALU helpers use
+    auto set_half = [&](Flags::Half half) {
+        out.store8(RBX, offset(&f.half), static_cast<u8>(half));
+    };
+    auto set_half_operands = [&](Flags::Half half, Reg lhs, Reg rhs) {
+        set_half(half);
+        out.store16(RBX, offset(&f.half_lhs), lhs);
+        out.store16(RBX, offset(&f.half_rhs), rhs);
+        out.store8(RBX, offset(&f.half_carry), u8(0));
+    };
+
+    // Exits back to the interpreter at the op's address, with nothing of it done
+    struct Exit {
+        u16 pc;
+        u8 dirty;
+        std::uint32_t pending;
+        std::vector<std::size_t> jumps;
+    };
+    std::vector<Exit> exits;
+    std::vector<std::size_t> leave;
+
+    // Host page for the address in eax, leaving if it isn't directly mapped.
+    // Afterwards eax is the offset into it
+    auto lookup = [&](const void *table) {
+        out.mov(RCX, RAX);
+        out.shr(RCX, 8);
+        out.mov64(RDX, reinterpret_cast<std::uint64_t>(table));
+        out.load64(RDX, RDX, RCX);
+        out.test64(RDX, RDX);
+        exits.back().jumps.push_back(out.jump(Emitter::zero));
+        out.and_(RAX, 0xFF);
+    };
+    auto read = [&](Reg dst) {
+        lookup(mmu.read_pages());
+        out.load8(dst, RDX, RAX);
+    };
+    auto write = [&](Reg src) {
+        lookup(mmu.write_pages());
+        out.store8(RDX, RAX, src);
+    };
+
+    out.push(RBX);
+    out.push(RBP);
+    out.push(R12);
+    out.push(R13);
+    out.push(R14);
+    out.mov64(RBX, RDI);
+    out.mov64(RBP, reinterpret_cast<std::uint64_t>(&cycles));
+
+    at = addr;
+    bool stored = false; // Registers, cycles and pc already written back
+    for(std::size_t i = 0; i < block.ops.size(); i++) {
+        const MicroOp& uop = block.ops[i];
+        u8 op = ops[i];
+        bool last = i + 1 == block.ops.size();
+        exits.push_back({ at, dirty, pending, {} });
+
+        if(!costs[i]) {
+            spill(dirty);
+            dirty = 0;
+            flush_cycles();
+            out.store16(RBX, offset(&pc), at);
+            out.mov64(RDI, RBX);
+            out.mov64(RSI, reinterpret_cast<std::uint64_t>(&uop));
+            out.mov64(RAX, reinterpret_cast<std::uint64_t>(&CPU::native_step));
+            out.call(RAX);
+            if(!last) {
+                out.test8(RAX, RAX);
+                leave.push_back(out.jump(Emitter::not_zero));
+            }
+            // The handler can change any of them
+            loaded = 0;
+            stored = true;
+            at += uop.length;
+            continue;
+        }
+        stored = false;
+
+        if(i == 0 || !costs[i - 1]) {
+            // Leave before the run if any of it would reach an event
+            std::uint32_t run = 0;
+            for(std::size_t j = i; j < costs.size() && costs[j]; j++) {
+                run += costs[j];
+            }
+            out.load64(RAX, RBP, 0);
+            out.add64(RAX, run);
+            out.cmp64(RAX, RBX, offset(&jit_limit));
+            exits.back().jumps.push_back(out.jump(Emitter::above_equal));
+        }
+
+        u8 imm8 = uop.imm;
+
+        if(jumps(op)) {
+            spill(dirty);
+            pending += uop.cycles;
+            flush_cycles();
+
+            u16 next = at + uop.length;
+            u16 target = op < 0x40 ? u16(next + i8(imm8)) : uop.imm;
+            out.store16(RBX, offset(&pc), next);
+
+            std::size_t not_taken = 0;
+            if(op != 0x18 && op != 0xC3) {
+                // NZ, Z, NC, C
+                u8 condition = (op >> 3) & 3;
+                out.cmp8(RBX, condition < 2 ? offset(&f.zero) : offset(&f.c), 0);
+                bool skip_if_clear = condition == 0 || condition == 3;
+                not_taken = out.jump(skip_if_clear ? Emitter::zero : Emitter::not_zero);
+            }
+
+            out.store16(RBX, offset(&pc), target);
+            out.add64(RBP, 0, 4);
+            if(not_taken) {
+                out.patch(not_taken, out.code.size());
+            }
+
+            stored = true;
+            break;
+        }
+
+        u8 dst = (op >> 3) & 7;
+        u8 src = op & 7;
+        switch(op) {
+            case 0x00: break;
+            case 0x01: out.mov(def(RegB), uop.imm >> 8); out.mov(def(RegC), imm8); break;
+            case 0x11: out.mov(def(RegD), uop.imm >> 8); out.mov(def(RegE), imm8); break;
+            case 0x21: out.mov(def(RegH), uop.imm >> 8); out.mov(def(RegL), imm8); break;
+            case 0x31: out.store16(RBX, offset(&sp), uop.imm); break;
+            case 0x03: step_pair(RegB, RegC, 1); break;
+            case 0x13: step_pair(RegD, RegE, 1); break;
+            case 0x23: step_pair(RegH, RegL, 1); break;
+            case 0x0B: step_pair(RegB, RegC, -1); break;
+            case 0x1B: step_pair(RegD, RegE, -1); break;
+            case 0x2B: step_pair(RegH, RegL, -1); break;
+            case 0x33:
+            case 0x3B:
+                out.load16(RAX, RBX, offset(&sp));
+                out.add(RAX, op == 0x33 ? 1 : -1);
+                out.store16(RBX, offset(&sp), RAX);
+                break;
+            case 0x02: pair(RegB, RegC); write(use(RegA)); break;
+            case 0x12: pair(RegD, RegE); write(use(RegA)); break;
+            case 0x0A: pair(RegB, RegC); read(def(RegA)); break;
+            case 0x1A: pair(RegD, RegE); read(def(RegA)); break;
+            case 0x22: pair(RegH, RegL); write(use(RegA)); step_pair(RegH, RegL, 1); break;
+            case 0x32: pair(RegH, RegL); write(use(RegA)); step_pair(RegH, RegL, -1); break;
+            case 0x2A: pair(RegH, RegL); read(def(RegA)); step_pair(RegH, RegL, 1); break;
+            case 0x3A: pair(RegH, RegL); read(def(RegA)); step_pair(RegH, RegL, -1); break;
+            case 0x36:
+                pair(RegH, RegL);
+                lookup(mmu.write_pages());
+                out.store8(RDX, RAX, imm8);
+                break;
+            case 0xEA: use(RegA); out.mov(RAX, uop.imm); write(pinned[RegA]); break;
+            case 0xFA: out.mov(RAX, uop.imm); read(def(RegA)); break;
+            case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+                out.mov(def(dst), imm8);
+                break;
+            case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+            case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D: {
+                bool inc = !(op & 1);
+                out.mov(RSI, 1u);
+                set_half_operands(inc ? Flags::Half::Add : Flags::Half::Sub, use(dst), RSI);
+                out.store8(RBX, offset(&f.n), u8(!inc));
+                out.add(def(dst), inc ? 1 : -1);
+                out.and_(pinned[dst], 0xFF);
+                out.store8(RBX, offset(&f.zero), pinned[dst]);
+                break;
+            }
+            case 0x2F:
+                out.xor_(use(RegA), 0xFF);
+                def(RegA);
+                out.store8(RBX, offset(&f.n), u8(1));
+                set_half(Flags::Half::Set);
+                break;
+            case 0x37:
+                out.store8(RBX, offset(&f.n), u8(0));
+                set_half(Flags::Half::Clear);
+                out.store8(RBX, offset(&f.c), u8(1));
+                break;
+            default:
+                if(op >= 0x40 && op < 0x80) {
+                    if(src == RegHL) {
+                        pair(RegH, RegL);
+                        read(def(dst));
+                    } else if(dst == RegHL) {
+                        pair(RegH, RegL);
+                        write(use(src));
+                    } else if(dst != src) {
+                        out.mov(def(dst), use(src));
+                    }
+                    break;
+                }
+
+                // ALU ops on A, the operand goes in esi unless it's pinned
+                Reg rhs = RSI;
+                if(op >= 0xC0) {
+                    out.mov(RSI, std::uint32_t(imm8));
+                } else if(src == RegHL) {
+                    pair(RegH, RegL);
+                    read(RSI);
+                } else {
+                    rhs = use(src);
+                }
+                Reg lhs = use(RegA);
+
+                switch(dst) {
+                    case 0: // ADD
+                    case 2: // SUB
+                    case 7: // CP
+                        set_half_operands(dst ? Flags::Half::Sub : Flags::Half::Add, lhs, rhs);
+                        out.store8(RBX, offset(&f.n), u8(dst != 0));
+                        out.mov(RAX, lhs);
+                        if(dst) {
+                            out.sub(RAX, rhs);
+                        } else {
+                            out.add(RAX, rhs);
+                        }
+                        out.store8(RBX, offset(&f.zero), RAX);
+                        if(dst != 7) {
+                            out.mov(def(RegA), RAX);
+                            out.and_(lhs, 0xFF);
+                        }
+                        out.shr(RAX, 8);
+                        out.and_(RAX, 1);
+                        out.store8(RBX, offset(&f.c), RAX);
+                        break;
+                    default: // AND, XOR, OR
+                        if(dst == 4) {
+                            out.and_(lhs, rhs);
+                        } else if(dst == 5) {
+                            out.xor_(lhs, rhs);
+                        } else {
+                            out.or_(lhs, rhs);
+                        }
+                        def(RegA);
+                        out.store8(RBX, offset(&f.zero), lhs);
+                        out.store8(RBX, offset(&f.n), u8(0));
+                        out.store8(RBX, offset(&f.c), u8(0));
+                        set_half(dst == 4 ? Flags::Half::Set : Flags::Half::Clear);
+                        break;
+                }
+                break;
+        }
+
+        pending += costs[i];
+        at += uop.length;
+    }
+
+    if(!stored) {
+        spill(dirty);
+        flush_cycles();
+        out.store16(RBX, offset(&pc), at);
+    }
+
+    std::size_t epilogue = out.code.size();
+    out.pop(R14);
+    out.pop(R13);
+    out.pop(R12);
+    out.pop(RBP);
+    out.pop(RBX);
+    out.ret();
+
+    for(const Exit& exit : exits) {
+        if(exit.jumps.empty()) {
+            continue;
+        }
+        for(std::size_t jump : exit.jumps) {
+            out.patch(jump, out.code.size());
+        }
+        spill(exit.dirty);
+        if(exit.pending) {
+            out.add64(RBP, 0, exit.pending);
+        }
+        out.store16(RBX, offset(&pc), exit.pc);
+        out.patch(out.jump(), epilogue);
+    }
+    for(std::size_t jump : leave) {
+        out.patch(jump, epilogue);
+    }
+
+    const u8 *code = jit_code.add(out.code);
+    return code ? reinterpret_cast<NativeBlock>(const_cast<u8 *>(code)) : nullptr;
+}
+
+#else
+
+CPU::NativeBlock CPU::compile_block(const Block&, u16) {
+    return nullptr;
+}
+
+#endif
+
+}
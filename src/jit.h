@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "types.h"
+
+namespace gb {
+
+// Executable memory for the recompiler in jit.cpp. Mapped on first use and
+// never freed while the CPU lives, ROM blocks stay valid for good
+class CodeBuffer {
+public:
+    CodeBuffer() = default;
+    CodeBuffer(const CodeBuffer&) = delete;
+    CodeBuffer& operator=(const CodeBuffer&) = delete;
+    ~CodeBuffer();
+
+    // Copies code in, nullptr when the buffer is full or can't be mapped
+    const u8 *add(const std::vector<u8>& code);
+
+private:
+    static constexpr std::size_t size = 8 << 20;
+
+    u8 *memory = nullptr;
+    std::size_t used = 0;
+    bool failed = false;
+};
+
+}
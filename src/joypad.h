@@ -0,0 +1,44 @@
+#pragma once
+#include "types.h"
+
+namespace gb {
+
+enum class Button : u8 {
+    Right = 1 << 0,
+    Left = 1 << 1,
+    Up = 1 << 2,
+    Down = 1 << 3,
+    A = 1 << 4,
+    B = 1 << 5,
+    Select = 1 << 6,
+    Start = 1 << 7
+};
+
+// Bit of button in Joypad::buttons
+constexpr u8 button_mask(Button button) {
+    return static_cast<u8>(button);
+}
+
+// Button state latched by the frontend, JOYP is only worked out when it
+// gets read
+class Joypad {
+public:
+    // Value of JOYP for the given select lines, pressed buttons read as 0
+    u8 read(u8 select) const {
+        u8 lines = 0x0F;
+
+        if((select & 0b0001'0000) == 0) {
+            lines &= ~(buttons & 0x0F);
+        }
+
+        if((select & 0b0010'0000) == 0) {
+            lines &= ~(buttons >> 4);
+        }
+
+        return 0b1100'0000 | (select & 0b0011'0000) | lines;
+    }
+
+    u8 buttons = 0; // Button bits, set when pressed
+};
+
+}
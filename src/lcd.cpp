@@ -0,0 +1,124 @@
+#include "lcd.h"
+#include "mmu.h"
+
+namespace gb {
+
+LCD::LCD(Scheduler& scheduler, IO& io) : scheduler(scheduler), io(io) {
+
+}
+
+bool LCD::advance(std::uint64_t when) {
+    bool frame_done = false;
+
+    switch(io.STAT & 0b11) {
+        case OAMScan:
+            set_mode(Drawing);
+            scheduler.schedule(Event::LCD, when + drawing_dots);
+            break;
+
+        case Drawing:
+            set_mode(HBlank);
+            scheduler.schedule(Event::LCD, when + hblank_dots);
+            ready = io.LY + 1;
+            break;
+
+        case HBlank:
+            set_ly(io.LY + 1);
+            if(io.LY == visible_lines) {
+                set_mode(VBlank);
+                io.IF |= 0b0000'0001;
+                scheduler.schedule(Event::LCD, when + line_dots);
+                frame_done = true;
+            } else {
+                set_mode(OAMScan);
+                scheduler.schedule(Event::LCD, when + oam_scan_dots);
+            }
+            break;
+
+        case VBlank:
+            if(io.LY + 1 == lines) {
+                start_frame();
+                set_ly(0);
+                set_mode(OAMScan);
+                scheduler.schedule(Event::LCD, when + oam_scan_dots);
+            } else {
+                set_ly(io.LY + 1);
+                scheduler.schedule(Event::LCD, when + line_dots);
+            }
+            break;
+    }
+
+    update_interrupt();
+    return frame_done;
+}
+
+void LCD::write_lcdc(u8 value) {
+    bool was_enabled = enabled();
+    io.LCDC = value;
+
+    if(was_enabled && !enabled()) {
+        // LY stays at 0 and STAT reads HBlank until it's switched back on
+        scheduler.cancel(Event::LCD);
+        io.LY = 0;
+        io.STAT &= 0b1111'1100;
+        stat_line = false;
+    } else if(!was_enabled && enabled()) {
+        start_frame();
+        set_ly(0);
+        set_mode(OAMScan);
+        scheduler.schedule_in(Event::LCD, oam_scan_dots);
+        update_interrupt();
+    }
+}
+
+void LCD::write_stat(u8 value) {
+    // Mode and coincidence bits are read only
+    io.STAT = 0b1000'0000 | (value & 0b0111'1000) | (io.STAT & 0b0000'0111);
+    update_interrupt();
+}
+
+void LCD::write_lyc(u8 value) {
+    io.LYC = value;
+    if(enabled()) {
+        set_ly(io.LY);
+        update_interrupt();
+    }
+}
+
+void LCD::start_frame() {
+    frame++;
+    ready = 0;
+}
+
+bool LCD::enabled() const {
+    return io.LCDC & 0b1000'0000;
+}
+
+void LCD::set_mode(Mode mode) {
+    io.STAT = (io.STAT & 0b1111'1100) | mode;
+}
+
+void LCD::set_ly(u8 ly) {
+    io.LY = ly;
+    if(io.LY == io.LYC) {
+        io.STAT |= 0b0000'0100;
+    } else {
+        io.STAT &= 0b1111'1011;
+    }
+}
+
+void LCD::update_interrupt() {
+    u8 mode = io.STAT & 0b11;
+    bool line = enabled() && (
+        (io.STAT & 0b0100'0000 && io.STAT & 0b0000'0100)
+        || (io.STAT & 0b0010'0000 && mode == OAMScan)
+        || (io.STAT & 0b0001'0000 && mode == VBlank)
+        || (io.STAT & 0b0000'1000 && mode == HBlank));
+
+    if(line && !stat_line) {
+        io.IF |= 0b0000'0010;
+    }
+    stat_line = line;
+}
+
+}
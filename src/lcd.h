@@ -0,0 +1,71 @@
+#pragma once
+#include "types.h"
+#include "scheduler.h"
+
+namespace gb {
+
+struct IO;
+
+// LCD timing: steps through OAM scan (mode 2), drawing (mode 3) and
+// HBlank (mode 0) on lines 0-143 and VBlank (mode 1) on lines 144-153.
+// Every mode change is an Event::LCD, LY and STAT only change then, and
+// the STAT interrupt is raised when one of its enabled conditions becomes
+// true.
+class LCD {
+public:
+    enum Mode : u8 {
+        HBlank,
+        VBlank,
+        OAMScan,
+        Drawing
+    };
+
+    // Dots (cycles) spent in each part of a line
+    static constexpr std::uint64_t oam_scan_dots = 80;
+    static constexpr std::uint64_t drawing_dots = 172;
+    static constexpr std::uint64_t hblank_dots = 204;
+    static constexpr std::uint64_t line_dots = 456;
+
+    static constexpr u8 visible_lines = 144;
+    static constexpr u8 lines = 154;
+
+    LCD(Scheduler& scheduler, IO& io);
+
+    // Event::LCD, the current mode ended at when. Returns true when VBlank
+    // starts and the whole frame has been drawn
+    bool advance(std::uint64_t when);
+
+    // Lines of the current frame that are past mode 3. Rendering them can
+    // wait as long as nothing they depend on changes
+    u8 lines_ready() const {
+        return ready;
+    }
+
+    // Changes whenever a new frame starts
+    std::uint32_t frame_count() const {
+        return frame;
+    }
+
+    void write_lcdc(u8 value);
+    void write_stat(u8 value);
+    void write_lyc(u8 value);
+
+private:
+    void start_frame();
+    bool enabled() const;
+
+    // Call update_interrupt once STAT is complete
+    void set_mode(Mode mode);
+    void set_ly(u8 ly);
+    // Raises IF bit 1 on a rising edge of the STAT interrupt line
+    void update_interrupt();
+
+    Scheduler& scheduler;
+    IO& io;
+
+    bool stat_line = false;
+    u8 ready = 0;
+    std::uint32_t frame = 0;
+};
+
+}
@@ -1,51 +1,170 @@
 #include "mmu.h"
+#include "gpu.h"
+#include <algorithm>
+#include <cerrno>
 #include <fstream>
-#include <cstring>
 #include <string>
+#include <cstring>
+#include <filesystem>
 #include <fmt/format.h>
-#include <SDL2/SDL.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace gb {
 MMU::MMU() :
-    vram(new u8[0x2000]),
+    vram(new u8[0x2000]()),
     hram(new u8[0x7F]) {
 
     wram[0] = std::make_unique<u8[]>(0x1000);
     wram[1] = std::make_unique<u8[]>(0x1000);
 
+    io_read.fill(&MMU::read_io);
+    io_read[0x00] = &MMU::read_joyp;
+    io_read[0x04] = &MMU::read_div;
+    io_read[0x05] = &MMU::read_tima;
+
+    io_write.fill(&MMU::write_io);
+    io_write[0x00] = &MMU::write_joyp;
+    io_write[0x02] = &MMU::write_sc;
+    io_write[0x04] = &MMU::write_div;
+    io_write[0x05] = &MMU::write_tima;
+    io_write[0x07] = &MMU::write_tac;
+    io_write[0x40] = &MMU::write_lcdc;
+    io_write[0x41] = &MMU::write_stat;
+    io_write[0x45] = &MMU::write_lyc;
+    io_write[0x46] = &MMU::write_dma;
+    io_write[0x47] = &MMU::write_palette;
+    io_write[0x48] = &MMU::write_palette;
+    io_write[0x49] = &MMU::write_palette;
+    io_write[0x42] = &MMU::write_scroll;
+    io_write[0x43] = &MMU::write_scroll;
+    io_write[0x4A] = &MMU::write_scroll;
+    io_write[0x4B] = &MMU::write_scroll;
+    io_write[0x50] = &MMU::write_boot;
+
+    io.TAC = 0b1111'1000;
+    io.STAT = 0b1000'0000;
+
+    update_map();
+}
+
+MMU::~MMU() {
+    if(ram && !ram_copy) {
+        sync_ram(MS_SYNC);
+        munmap(ram, ram_size);
+    }
+
+    if(rom && !rom_copy) {
+        munmap(const_cast<u8 *>(rom), rom_size);
+    }
+}
+
+void MMU::update_map() {
+    read_map.fill(nullptr);
+    write_map.fill(nullptr);
+
+    if(rom) {
+        const u8 *bank0 = rom + (rom_bank0 % rom_banks) * 0x4000;
+        const u8 *bank1 = rom + (rom_bank % rom_banks) * 0x4000;
+
+        for(u16 page = 0x00; page <= 0x3F; page++) {
+            read_map[page] = bank0 + (page << 8);
+        }
+
+        for(u16 page = 0x40; page <= 0x7F; page++) {
+            read_map[page] = bank1 + ((page - 0x40) << 8);
+        }
+    }
+
+    if(io.BOOT == 0) {
+        read_map[0x00] = bios.data();
+    }
+
+    if(ram && ram_enable && !(mbc == MBC::MBC3 && ram_bank >= 0x08)) {
+        const u8 *bank = ram + (ram_bank % ram_banks) * 0x2000;
+        u16 pages = std::min<std::size_t>(ram_size, 0x2000) >> 8;
+
+        for(u16 page = 0; page < pages; page++) {
+            read_map[0xA0 + page] = bank + (page << 8);
+        }
+    }
+
+    for(u16 page = 0x80; page <= 0x9F; page++) {
+        read_map[page] = write_map[page] = vram.get() + ((page - 0x80) << 8);
+    }
+
+    // VRAM writes go through set_slow to keep the tile cache current and
+    // render pending lines first
+    for(u16 page = 0x80; page <= 0x9F; page++) {
+        write_map[page] = nullptr;
+    }
+
+    for(u16 page = 0xC0; page <= 0xCF; page++) {
+        read_map[page] = write_map[page] = wram[0].get() + ((page - 0xC0) << 8);
+    }
+
+    for(u16 page = 0xD0; page <= 0xDF; page++) {
+        read_map[page] = write_map[page] = wram[1].get() + ((page - 0xD0) << 8);
+    }
+
+    for(u16 page = 0x00; page <= 0xFF; page++) {
+        code_write_map[page] = nullptr;
+        if(code_pages[page]) {
+            std::swap(code_write_map[page], write_map[page]);
+        }
+    }
+
+    code_epoch++;
+}
+
+void MMU::trap_writes(u8 page) {
+    code_pages[page] = true;
+    update_map();
 }
 
-void MMU::set(u16 addr, u8 value) {
+void MMU::set_slow(u16 addr, u8 value) {
 
-    if(addr >= 0x2000 && addr <= 0x3FFF) {
-        rom_bank = value & 0b11111;
-        if(rom_bank % 0x20 == 0)
-            rom_bank += 1;
+    if(code_pages[addr >> 8]) {
+        code_versions[addr >> 8]++;
+        code_epoch++;
+
+        u8 *page = code_write_map[addr >> 8];
+        if(page) {
+            page[addr & 0xFF] = value;
+            return;
+        }
     }
 
-    if(addr >= 0x8000 && addr <= 0x9FFF) {
-        vram[addr & 0x3FFF] = value;
-    } else if(addr >= 0xC000 && addr <= 0xCFFF) {
-        wram[0][addr & 0xFFF] = value;
-    } else if(addr >= 0xD000 && addr <= 0xDFFF) {
-        wram[1][addr & 0xFFF] = value;
+    if(addr <= 0x7FFF) {
+        switch(mbc) {
+            case MBC::None: break;
+            case MBC::MBC1: write_mbc1(addr, value); break;
+            case MBC::MBC3: write_mbc3(addr, value); break;
+            case MBC::MBC5: write_mbc5(addr, value); break;
+        }
+    } else if(addr <= 0x97FF) {
+        sync_video();
+        u16 offset = addr & 0x1FFF;
+        vram[offset] = value;
+        tiles.write(offset, vram[offset & ~1], vram[offset | 1]);
+    } else if(addr <= 0x9FFF) {
+        sync_video();
+        vram[addr & 0x1FFF] = value;
+    } else if(addr >= 0xA000 && addr <= 0xBFFF) {
+        if(read_map[addr >> 8]) {
+            std::size_t offset = read_map[addr >> 8] - ram + (addr & 0xFF);
+            ram[offset] = value;
+            ram_dirty |= std::uint64_t(1) << (offset / ram_page_size);
+        }
     } else if(addr >= 0xFE00 && addr <= 0xFE9F) {
-        std::array<u8, sizeof oam> bytes;
-        std::memcpy(bytes.data(), &oam, sizeof oam);
-        bytes[addr & 0xFF] = value;
-        std::memcpy(&oam, bytes.data(), sizeof oam);
+        sync_video();
+        oam_bytes[addr & 0xFF] = value;
+        oam_version++;
     } else if(addr >= 0xFF00 && addr <= 0xFF7F) {
-        if(addr == 0xFF46) {
-            
-            u16 src_addr = ((u16) value) << 8;
-            for(u16 addr = 0x0; addr < 160; addr++) {
-                set(0xFE00 + addr, get(src_addr + addr));
-            }
-        }
-        std::array<u8, sizeof io> bytes;
-        std::memcpy(bytes.data(), &io, sizeof io);
-        bytes[addr & 0x7F] = value;
-        std::memcpy(&io, bytes.data(), sizeof io);
+        u8 reg = addr & 0x7F;
+        (this->*io_write[reg])(reg, value);
     } else if(addr >= 0xFF80 && addr <= 0xFFFE) {
         hram[addr & 0x7F] = value;
     } else if(addr == 0xFFFF) {
@@ -53,27 +172,212 @@ void MMU::set(u16 addr, u8 value) {
     }
 }
 
-u8 MMU::get(u16 addr) {
-    if(addr >= 0x0000 && addr <= 0xFF && io.BOOT == 0) {
-        return bios[addr & 0xFF];
-    } else if(addr >= 0x0000 && addr <= 0x3FFF) {
-        return rom[0][addr & 0x3FFF];
-    } else if(addr >= 0x4000 && addr <= 0x7FFF) {
-        return rom[rom_bank][addr & 0x3FFF];
-    } else if(addr >= 0xC000 && addr <= 0xCFFF) {
-        return wram[0][addr & 0xFFF];
-    } else if(addr >= 0xD000 && addr <= 0xDFFF) {
-        return wram[1][addr & 0xFFF];
-    } else if(addr >= 0x8000 && addr <= 0x9FFF) {
-        return vram[addr - 0x8000];
-    } else if(addr >= 0xFF00 && addr <= 0xFF7F) {
-        std::array<u8, sizeof io> bytes;
-        std::memcpy(bytes.data(), &io, sizeof io);
-        return bytes[addr & 0x7F];
+void MMU::write_ram_enable(u8 value) {
+    bool enable = (value & 0x0F) == 0x0A;
+
+    // Games disable RAM once they're done saving, which is a good point to
+    // push the changes out
+    if(ram_enable && !enable) {
+        flush_ram();
+    }
+
+    ram_enable = enable;
+    update_map();
+}
+
+void MMU::write_mbc1(u16 addr, u8 value) {
+    if(addr <= 0x1FFF) {
+        write_ram_enable(value);
+        return;
+    } else if(addr <= 0x3FFF) {
+        bank_lo = value & 0b11111;
+        if(bank_lo == 0)
+            bank_lo = 1;
+    } else if(addr <= 0x5FFF) {
+        bank_hi = value & 0b11;
+    } else {
+        bank_mode = value & 1;
+    }
+
+    rom_bank = bank_hi << 5 | bank_lo;
+    rom_bank0 = bank_mode ? bank_hi << 5 : 0;
+    ram_bank = bank_mode ? bank_hi : 0;
+    update_map();
+}
+
+void MMU::write_mbc3(u16 addr, u8 value) {
+    if(addr <= 0x1FFF) {
+        write_ram_enable(value);
+    } else if(addr <= 0x3FFF) {
+        rom_bank = value & 0x7F;
+        if(rom_bank == 0)
+            rom_bank = 1;
+        update_map();
+    } else if(addr <= 0x5FFF) {
+        // 0x08-0x0C select the RTC registers, which aren't emulated
+        ram_bank = value & 0x0F;
+        update_map();
+    }
+}
+
+void MMU::write_mbc5(u16 addr, u8 value) {
+    if(addr <= 0x1FFF) {
+        write_ram_enable(value);
+    } else if(addr <= 0x2FFF) {
+        rom_bank = (rom_bank & 0x100) | value;
+        update_map();
+    } else if(addr <= 0x3FFF) {
+        rom_bank = (value & 1) << 8 | (rom_bank & 0xFF);
+        update_map();
+    } else if(addr <= 0x5FFF) {
+        ram_bank = value & 0x0F;
+        update_map();
+    }
+}
+
+u8 MMU::read_io(u8 reg) {
+    return io_bytes[reg];
+}
+
+u8 MMU::read_joyp(u8) {
+    return joypad.read(io.JOYP);
+}
+
+u8 MMU::read_div(u8) {
+    return timer.read_div();
+}
+
+u8 MMU::read_tima(u8) {
+    return timer.read_tima();
+}
+
+void MMU::write_io(u8 reg, u8 value) {
+    io_bytes[reg] = value;
+}
+
+void MMU::write_joyp(u8, u8 value) {
+    u8 before = joypad.read(io.JOYP);
+
+    // Only the select lines are writable, the rest is computed on read
+    io.JOYP = value & 0b0011'0000;
+
+    if(before & ~joypad.read(io.JOYP) & 0x0F) {
+        io.IF |= 0b0001'0000;
+    }
+}
+
+void MMU::set_buttons(u8 buttons) {
+    u8 before = joypad.read(io.JOYP);
+
+    joypad.buttons = buttons;
+
+    if(before & ~joypad.read(io.JOYP) & 0x0F) {
+        io.IF |= 0b0001'0000;
+    }
+}
+
+void MMU::write_div(u8, u8) {
+    timer.write_div();
+}
+
+void MMU::write_tima(u8, u8 value) {
+    timer.write_tima(value);
+}
+
+void MMU::write_tac(u8, u8 value) {
+    timer.write_tac(value);
+}
+
+void MMU::write_sc(u8, u8 value) {
+    io.SC = value;
+
+    // Transfers on the internal clock shift out 8 bits at 8192Hz. With no
+    // link partner the bits shifted in are all ones
+    if((value & 0b1000'0001) == 0b1000'0001) {
+        scheduler.schedule_in(Event::Serial, 8 * 512);
+    }
+}
+
+void MMU::write_stat(u8, u8 value) {
+    lcd.write_stat(value);
+}
+
+void MMU::write_lcdc(u8, u8 value) {
+    sync_video();
+    lcd.write_lcdc(value);
+}
+
+void MMU::write_lyc(u8, u8 value) {
+    lcd.write_lyc(value);
+}
+
+void MMU::write_dma(u8, u8 value) {
+    sync_video();
+    io.DMA = value;
+
+    // The source never crosses a page, so a mapped page can be copied in one go
+    const u8 *page = read_map[value];
+    if(page) {
+        std::memcpy(oam_bytes.data(), page, oam_bytes.size());
+    } else {
+        u16 src_addr = ((u16) value) << 8;
+        for(u16 addr = 0x0; addr < oam_bytes.size(); addr++) {
+            oam_bytes[addr] = get_slow(src_addr + addr);
+        }
+    }
+
+    oam_version++;
+
+    // 160 machine cycles plus one of startup delay
+    dma_active = true;
+    scheduler.schedule_in(Event::DMA, 161 * 4);
+}
+
+void MMU::write_boot(u8, u8 value) {
+    io.BOOT = value;
+    update_map();
+}
+
+void MMU::write_palette(u8 reg, u8 value) {
+    sync_video();
+    io_bytes[reg] = value;
+    palette.write(reg - 0x47, value);
+}
+
+void MMU::write_scroll(u8 reg, u8 value) {
+    sync_video();
+    io_bytes[reg] = value;
+}
+
+void MMU::sync_video() {
+    if(gpu) {
+        gpu->catch_up();
+    }
+}
+
+void MMU::flush_ram() {
+    if(ram && !ram_copy) {
+        sync_ram(MS_ASYNC);
+    }
+}
+
+void MMU::sync_ram(int flags) {
+    for(std::size_t page = 0; page * ram_page_size < ram_size; page++) {
+        if(ram_dirty & (std::uint64_t(1) << page)) {
+            std::size_t offset = page * ram_page_size;
+            msync(ram + offset, std::min(ram_page_size, ram_size - offset), flags);
+        }
+    }
+
+    ram_dirty = 0;
+}
+
+u8 MMU::get_slow(u16 addr) {
+    if(addr >= 0xFF00 && addr <= 0xFF7F) {
+        u8 reg = addr & 0x7F;
+        return (this->*io_read[reg])(reg);
     } else if(addr >= 0xFE00 && addr <= 0xFE9F) {
-        std::array<u8, sizeof oam> bytes;
-        std::memcpy(bytes.data(), &oam, sizeof oam);
-        return bytes[addr & 0xFF];
+        return oam_bytes[addr & 0xFF];
     } else if(addr >= 0xFF80 && addr <= 0xFFFE) {
         return hram[addr & 0x7F];
     } else if(addr == 0xFFFF) {
@@ -90,17 +394,127 @@ void MMU::load_bios(const std::string_view file) {
 }
 
 void MMU::load_rom(std::string_view file) {
-    std::ifstream ifs{std::string(file), std::ios::binary};
+    int fd = open(std::string(file).c_str(), O_RDONLY);
+    if(fd == -1) {
+        fmt::print("Unable to open rom {}: {}\n", file, std::strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        fmt::print("Unable to stat rom {}: {}\n", file, std::strerror(errno));
+        close(fd);
+        return;
+    }
+    rom_size = st.st_size;
+
+    if(rom_size >= 0x8000 && rom_size % 0x4000 == 0) {
+        void *data = mmap(nullptr, rom_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+            rom = static_cast<const u8 *>(data);
+        }
+    }
+
+    if(!rom) {
+        // Odd sized dumps are padded out to whole banks in memory instead
+        std::size_t size = std::max<std::size_t>(0x8000, (rom_size + 0x3FFF) & ~0x3FFF);
+        rom_copy = std::make_unique<u8[]>(size);
+        std::memset(rom_copy.get(), 0xFF, size);
+        // pread can come back short, keep going until the whole file is in.
+        // An empty file fails on the first read
+        std::size_t done = 0;
+        do {
+            ssize_t got = pread(fd, rom_copy.get() + done, rom_size - done, done);
+            if(got < 0 && errno == EINTR) {
+                continue;
+            }
+            if(got <= 0) {
+                fmt::print("Unable to read rom {}: {}\n", file, got < 0 ? std::strerror(errno) : "unexpected end of file");
+                rom_copy.reset();
+                rom_size = 0;
+                close(fd);
+                return;
+            }
+            done += got;
+        } while(done < rom_size);
+        rom_size = size;
+        rom = rom_copy.get();
+    }
+
+    close(fd);
+
+    rom_banks = rom_size / 0x4000;
 
-    rom[0] = std::make_unique<u8[]>(0x4000);
-    rom[1] = std::make_unique<u8[]>(0x4000);
-    rom[2] = std::make_unique<u8[]>(0x4000);
-    rom[3] = std::make_unique<u8[]>(0x4000);
+    switch(rom[0x147]) {
+        case 0x00: case 0x08: case 0x09:
+            mbc = MBC::None; break;
+        case 0x01: case 0x02: case 0x03:
+            mbc = MBC::MBC1; break;
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            mbc = MBC::MBC3; break;
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            mbc = MBC::MBC5; break;
+        default:
+            fmt::print("Unsupported cartridge type {:02X}, assuming MBC1\n", rom[0x147]);
+            mbc = MBC::MBC1; break;
+    }
+
+    load_ram(file);
+    update_map();
+}
+
+void MMU::load_ram(std::string_view rom_file) {
+    switch(rom[0x149]) {
+        case 0x01: ram_size = 0x800; break;
+        case 0x02: ram_size = 0x2000; break;
+        case 0x03: ram_size = 0x8000; break;
+        case 0x04: ram_size = 0x20000; break;
+        case 0x05: ram_size = 0x10000; break;
+        default: return;
+    }
+
+    ram_banks = std::max<std::size_t>(1, ram_size / 0x2000);
+
+    bool battery = false;
+    switch(rom[0x147]) {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F:
+        case 0x10: case 0x13: case 0x1B: case 0x1E:
+            battery = true; break;
+    }
+
+    if(battery) {
+        std::filesystem::path save{rom_file};
+        save.replace_extension(".sav");
+
+        int fd = open(save.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd != -1) {
+            struct stat st;
+            bool sized = fstat(fd, &st) == 0
+                && ((std::size_t) st.st_size >= ram_size || ftruncate(fd, ram_size) == 0);
+
+            if(sized) {
+                void *data = mmap(nullptr, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if(data != MAP_FAILED) {
+                    ram = static_cast<u8 *>(data);
+                }
+            }
+            close(fd);
+        }
+
+        if(!ram) {
+            fmt::print("Unable to map save file {}, saves will be lost\n", save.string());
+        }
+
+        ram_page_size = std::max<std::size_t>(0x1000, sysconf(_SC_PAGESIZE));
+    }
+
+    if(!ram) {
+        ram_copy = std::make_unique<u8[]>(ram_size);
+        ram = ram_copy.get();
+    }
 
-    ifs.read(reinterpret_cast<char *>(rom[0].get()), 0x4000);
-    ifs.read(reinterpret_cast<char *>(rom[1].get()), 0x4000);
-    ifs.read(reinterpret_cast<char *>(rom[2].get()), 0x4000);
-    ifs.read(reinterpret_cast<char *>(rom[3].get()), 0x4000);
+    // Without a mapper there is no enable register
+    ram_enable = mbc == MBC::None;
 }
 
 
@@ -3,8 +3,16 @@
 #include <memory>
 #include <string_view>
 #include "types.h"
+#include "scheduler.h"
+#include "joypad.h"
+#include "timer.h"
+#include "lcd.h"
+#include "tiles.h"
+#include "palette.h"
 namespace gb {
 
+class GPU;
+
 struct IO {
     u8 JOYP; // ff00
     u8 SB; // ff01
@@ -69,6 +77,15 @@ struct OAM {
     u8 priority: 1;
 } __attribute__((packed));
 
+static_assert(sizeof(IO) == 0x80);
+static_assert(sizeof(OAM) == 4);
+
+enum class MBC {
+    None,
+    MBC1,
+    MBC3,
+    MBC5
+};
 
 class MMU {
 public:
@@ -98,10 +115,57 @@ public:
 
 
     MMU();
+    ~MMU();
 
-    void set(u16 addr, u8 value);
+    void set(u16 addr, u8 value) {
+        u8 *page = write_map[addr >> 8];
+        if(page) {
+            page[addr & 0xFF] = value;
+        } else {
+            set_slow(addr, value);
+        }
+    }
 
-    u8 get(u16 addr);
+    u8 get(u16 addr) {
+        const u8 *page = read_map[addr >> 8];
+        if(page) {
+            return page[addr & 0xFF];
+        }
+        return get_slow(addr);
+    }
+
+    // While an OAM DMA is running the CPU can only reach IO, HRAM and IE,
+    // so writing DMA again restarts the transfer
+    bool dma_blocked(u16 addr) const {
+        return dma_active && addr < 0xFF00;
+    }
+
+    // Backing memory of the page holding addr, nullptr if it isn't directly mapped
+    const u8 *read_page(u16 addr) const {
+        return read_map[addr >> 8];
+    }
+
+    // Page tables for the recompiler, nullptr entries need get_slow/set_slow
+    const u8 *const *read_pages() const {
+        return read_map.data();
+    }
+
+    u8 *const *write_pages() const {
+        return write_map.data();
+    }
+
+    // Routes writes to a RAM page holding cached code through set_slow, so
+    // its code_version changes whenever it is modified
+    void trap_writes(u8 page);
+
+    std::uint32_t code_version(u16 addr) const {
+        return code_versions[addr >> 8];
+    }
+
+    // The 32x32 tile map at 0x9C00 if high, else 0x9800
+    const u8 *tile_map(bool high) const {
+        return vram.get() + (high ? 0x1C00 : 0x1800);
+    }
 
     MemRef operator[](u16 addr) {
         return MemRef{*this, addr};
@@ -111,14 +175,124 @@ public:
 
     void load_rom(std::string_view file);
 
-    std::array<OAM, 40> oam = {};
-    struct IO io = {};
+    // Latches the pressed buttons, see Button. Raises the joypad interrupt
+    // when a selected button goes down
+    void set_buttons(u8 buttons);
+
+    // Schedules write back of modified cartridge RAM pages to the save file
+    void flush_ram();
+
+    // IO and OAM are stored as plain bytes for the memory map, with the
+    // structs as typed views for the GPU/CPU
+    union {
+        std::array<u8, 0xA0> oam_bytes = {};
+        std::array<OAM, 40> oam;
+    };
+    union {
+        std::array<u8, 0x80> io_bytes = {};
+        struct IO io;
+    };
     u8 IE = 0;
-    u8 rom_bank = 1;
+
+    MBC mbc = MBC::None;
+    u16 rom_bank = 1; // Bank mapped at 0x4000-0x7FFF
+    u16 rom_bank0 = 0; // Bank mapped at 0x0000-0x3FFF
+    u8 ram_bank = 0;
+    bool ram_enable = false;
+
+    bool dma_active = false; // Cleared by Event::DMA
+    // Bumped on every OAM write and DMA
+    std::uint32_t oam_version = 0;
+
+    // Set by the GPU. Lines are rendered lazily, so before anything they
+    // read changes the lines that are already due get rendered
+    GPU *gpu = nullptr;
+    void sync_video();
+
+    // Bumped whenever the mapping or any trapped code page changes
+    std::uint32_t code_epoch = 0;
+
+    // Decoded copy of the tile data, updated by set_slow
+    TileCache tiles;
+    // BGP/OBP0/OBP1 as colours, updated when they're written
+    Palette palette;
+
+    Scheduler scheduler;
+    Joypad joypad;
+    Timer timer{scheduler, io};
+    LCD lcd{scheduler, io};
 
 private:
+    void set_slow(u16 addr, u8 value);
+    u8 get_slow(u16 addr);
+
+    using IORead = u8 (MMU::*)(u8 reg);
+    using IOWrite = void (MMU::*)(u8 reg, u8 value);
+
+    u8 read_io(u8 reg);
+    u8 read_joyp(u8 reg);
+    u8 read_div(u8 reg);
+    u8 read_tima(u8 reg);
+
+    void write_io(u8 reg, u8 value);
+    void write_joyp(u8 reg, u8 value);
+    void write_div(u8 reg, u8 value);
+    void write_tima(u8 reg, u8 value);
+    void write_tac(u8 reg, u8 value);
+    void write_sc(u8 reg, u8 value);
+    void write_stat(u8 reg, u8 value);
+    void write_lcdc(u8 reg, u8 value);
+    void write_lyc(u8 reg, u8 value);
+    void write_dma(u8 reg, u8 value);
+    void write_boot(u8 reg, u8 value);
+    void write_palette(u8 reg, u8 value);
+    void write_scroll(u8 reg, u8 value);
+
+    void write_mbc1(u16 addr, u8 value);
+    void write_mbc3(u16 addr, u8 value);
+    void write_mbc5(u16 addr, u8 value);
+    void write_ram_enable(u8 value);
+
+    void load_ram(std::string_view rom_file);
+    void sync_ram(int flags);
+
+    // Read and write handlers for 0xFF00-0xFF7F, indexed by addr & 0x7F
+    std::array<IORead, 0x80> io_read;
+    std::array<IOWrite, 0x80> io_write;
+
+    // Rebuilds the page tables, call whenever the banks, RAM enable or io.BOOT change
+    void update_map();
+
+    // One entry per 256 byte page, nullptr pages go through get_slow/set_slow
+    std::array<const u8 *, 256> read_map = {};
+    std::array<u8 *, 256> write_map = {};
+
+    // Pages with cached code, and where their writes really go
+    std::array<bool, 256> code_pages = {};
+    std::array<u8 *, 256> code_write_map = {};
+    std::array<std::uint32_t, 256> code_versions = {};
+
     std::array<u8, 256> bios; // 0x0000-0x00FF
-    std::array<std::unique_ptr<u8[]>, 256> rom; // Rom banks 0x0000-0x7FFF
+    // Whole cartridge, mmap'd read only or copied into rom_copy when the
+    // file can't be mapped as whole banks
+    const u8 *rom = nullptr;
+    std::size_t rom_size = 0;
+    std::size_t rom_banks = 0;
+    std::unique_ptr<u8[]> rom_copy;
+
+    // MBC registers as written, rom_bank/rom_bank0/ram_bank are derived
+    u16 bank_lo = 1;
+    u8 bank_hi = 0;
+    bool bank_mode = false;
+
+    // Cartridge RAM, mmap'd from the .sav file for battery backed carts.
+    // Writes go through set_slow so the touched pages can be marked dirty
+    u8 *ram = nullptr;
+    std::size_t ram_size = 0;
+    std::size_t ram_banks = 0;
+    std::unique_ptr<u8[]> ram_copy;
+    std::size_t ram_page_size = 0x1000;
+    std::uint64_t ram_dirty = 0; // One bit per ram_page_size page
 
     std::unique_ptr<u8[]> vram; // 0x8000-0x9FFF
 
@@ -0,0 +1,261 @@
+#pragma once
+
+// Base instruction set as an X-macro, OP(opcode, body). cpu.cpp expands it
+// into the handler table used by CPU::step and the threaded loop in CPU::run.
+#define GB_OPCODES(OP) \
+    OP(00, ) \
+    OP(01, bc = fetch16();) \
+    OP(02, write8(bc, a);) \
+    OP(03, ++bc;) \
+    OP(04, b = alu_inc(b);) \
+    OP(05, b = alu_dec(b);) \
+    OP(06, b = fetch8();) \
+    OP(07, a = bit_rlc(a, true);) \
+    OP(08, write16(fetch16(), sp);) \
+    OP(09, hl = alu_add16(hl, bc);) \
+    OP(0A, a = read8(bc);) \
+    OP(0B, --bc;) \
+    OP(0C, c = alu_inc(c);) \
+    OP(0D, c = alu_dec(c);) \
+    OP(0E, c = fetch8();) \
+    OP(0F, a = bit_rrc(a, true);) \
+    OP(10, op_stop();) \
+    OP(11, de = fetch16();) \
+    OP(12, write8(de, a);) \
+    OP(13, ++de;) \
+    OP(14, d = alu_inc(d);) \
+    OP(15, d = alu_dec(d);) \
+    OP(16, d = fetch8();) \
+    OP(17, a = bit_rl(a, true);) \
+    OP(18, op_jr(Condition::None, fetch8());) \
+    OP(19, hl = alu_add16(hl, de);) \
+    OP(1A, a = read8(de);) \
+    OP(1B, --de;) \
+    OP(1C, e = alu_inc(e);) \
+    OP(1D, e = alu_dec(e);) \
+    OP(1E, e = fetch8();) \
+    OP(1F, a = bit_rr(a, true);) \
+    OP(20, op_jr(Condition::NZ, fetch8());) \
+    OP(21, hl = fetch16();) \
+    OP(22, write8(hl++, a);) \
+    OP(23, ++hl;) \
+    OP(24, h = alu_inc(h);) \
+    OP(25, h = alu_dec(h);) \
+    OP(26, h = fetch8();) \
+    OP(27, ) \
+    OP(28, op_jr(Condition::Z, fetch8());) \
+    OP(29, hl = alu_add16(hl, hl);) \
+    OP(2A, a = read8(hl++);) \
+    OP(2B, --hl;) \
+    OP(2C, l = alu_inc(l);) \
+    OP(2D, l = alu_dec(l);) \
+    OP(2E, l = fetch8();) \
+    OP(2F, a = ~a; f.n = true; f.set_h(true);) \
+    OP(30, op_jr(Condition::NC, fetch8());) \
+    OP(31, sp = fetch16();) \
+    OP(32, write8(hl--, a);) \
+    OP(33, ++sp;) \
+    OP(34, write8(hl, alu_inc(read8(hl)));) \
+    OP(35, write8(hl, alu_dec(read8(hl)));) \
+    OP(36, write8(hl, fetch8());) \
+    OP(37, f.n = false; f.set_h(false); f.c = true;) \
+    OP(38, op_jr(Condition::C, fetch8());) \
+    OP(39, hl = alu_add16(hl, sp);) \
+    OP(3A, a = read8(hl--);) \
+    OP(3B, --sp;) \
+    OP(3C, a = alu_inc(a);) \
+    OP(3D, a = alu_dec(a);) \
+    OP(3E, a = fetch8();) \
+    OP(3F, f.n = false; f.set_h(false); f.c = !f.c;) \
+    OP(40, /* b = b */) \
+    OP(41, b = c;) \
+    OP(42, b = d;) \
+    OP(43, b = e;) \
+    OP(44, b = h;) \
+    OP(45, b = l;) \
+    OP(46, b = read8(hl);) \
+    OP(47, b = a;) \
+    OP(48, c = b;) \
+    OP(49, /* c = c */) \
+    OP(4A, c = d;) \
+    OP(4B, c = e;) \
+    OP(4C, c = h;) \
+    OP(4D, c = l;) \
+    OP(4E, c = read8(hl);) \
+    OP(4F, c = a;) \
+    OP(50, d = b;) \
+    OP(51, d = c;) \
+    OP(52, /* d = d */) \
+    OP(53, d = e;) \
+    OP(54, d = h;) \
+    OP(55, d = l;) \
+    OP(56, d = read8(hl);) \
+    OP(57, d = a;) \
+    OP(58, e = b;) \
+    OP(59, e = c;) \
+    OP(5A, e = d;) \
+    OP(5B, /* e = e */) \
+    OP(5C, e = h;) \
+    OP(5D, e = l;) \
+    OP(5E, e = read8(hl);) \
+    OP(5F, e = a;) \
+    OP(60, h = b;) \
+    OP(61, h = c;) \
+    OP(62, h = d;) \
+    OP(63, h = e;) \
+    OP(64, /* h = h */) \
+    OP(65, h = l;) \
+    OP(66, h = read8(hl);) \
+    OP(67, h = a;) \
+    OP(68, l = b;) \
+    OP(69, l = c;) \
+    OP(6A, l = d;) \
+    OP(6B, l = e;) \
+    OP(6C, l = h;) \
+    OP(6D, /* l = l */) \
+    OP(6E, l = read8(hl);) \
+    OP(6F, l = a;) \
+    OP(70, write8(hl, b);) \
+    OP(71, write8(hl, c);) \
+    OP(72, write8(hl, d);) \
+    OP(73, write8(hl, e);) \
+    OP(74, write8(hl, h);) \
+    OP(75, write8(hl, l);) \
+    OP(76, op_halt();) \
+    OP(77, write8(hl, a);) \
+    OP(78, a = b;) \
+    OP(79, a = c;) \
+    OP(7A, a = d;) \
+    OP(7B, a = e;) \
+    OP(7C, a = h;) \
+    OP(7D, a = l;) \
+    OP(7E, a = read8(hl);) \
+    OP(7F, /* a = a */) \
+    OP(80, a = alu_add(a, b, false);) \
+    OP(81, a = alu_add(a, c, false);) \
+    OP(82, a = alu_add(a, d, false);) \
+    OP(83, a = alu_add(a, e, false);) \
+    OP(84, a = alu_add(a, h, false);) \
+    OP(85, a = alu_add(a, l, false);) \
+    OP(86, a = alu_add(a, read8(hl), false);) \
+    OP(87, a = alu_add(a, a, false);) \
+    OP(88, a = alu_add(a, b, true);) \
+    OP(89, a = alu_add(a, c, true);) \
+    OP(8A, a = alu_add(a, d, true);) \
+    OP(8B, a = alu_add(a, e, true);) \
+    OP(8C, a = alu_add(a, h, true);) \
+    OP(8D, a = alu_add(a, l, true);) \
+    OP(8E, a = alu_add(a, read8(hl), true);) \
+    OP(8F, a = alu_add(a, a, true);) \
+    OP(90, a = alu_sub(a, b, false);) \
+    OP(91, a = alu_sub(a, c, false);) \
+    OP(92, a = alu_sub(a, d, false);) \
+    OP(93, a = alu_sub(a, e, false);) \
+    OP(94, a = alu_sub(a, h, false);) \
+    OP(95, a = alu_sub(a, l, false);) \
+    OP(96, a = alu_sub(a, read8(hl), false);) \
+    OP(97, a = alu_sub(a, a, false);) \
+    OP(98, a = alu_sub(a, b, true);) \
+    OP(99, a = alu_sub(a, c, true);) \
+    OP(9A, a = alu_sub(a, d, true);) \
+    OP(9B, a = alu_sub(a, e, true);) \
+    OP(9C, a = alu_sub(a, h, true);) \
+    OP(9D, a = alu_sub(a, l, true);) \
+    OP(9E, a = alu_sub(a, read8(hl), true);) \
+    OP(9F, a = alu_sub(a, a, true);) \
+    OP(A0, a = alu_and(a, b);) \
+    OP(A1, a = alu_and(a, c);) \
+    OP(A2, a = alu_and(a, d);) \
+    OP(A3, a = alu_and(a, e);) \
+    OP(A4, a = alu_and(a, h);) \
+    OP(A5, a = alu_and(a, l);) \
+    OP(A6, a = alu_and(a, read8(hl));) \
+    OP(A7, a = alu_and(a, a);) \
+    OP(A8, a = alu_xor(a, b);) \
+    OP(A9, a = alu_xor(a, c);) \
+    OP(AA, a = alu_xor(a, d);) \
+    OP(AB, a = alu_xor(a, e);) \
+    OP(AC, a = alu_xor(a, h);) \
+    OP(AD, a = alu_xor(a, l);) \
+    OP(AE, a = alu_xor(a, read8(hl));) \
+    OP(AF, a = alu_xor(a, a);) \
+    OP(B0, a = alu_or(a, b);) \
+    OP(B1, a = alu_or(a, c);) \
+    OP(B2, a = alu_or(a, d);) \
+    OP(B3, a = alu_or(a, e);) \
+    OP(B4, a = alu_or(a, h);) \
+    OP(B5, a = alu_or(a, l);) \
+    OP(B6, a = alu_or(a, read8(hl));) \
+    OP(B7, a = alu_or(a, a);) \
+    OP(B8, alu_sub(a, b, false);) \
+    OP(B9, alu_sub(a, c, false);) \
+    OP(BA, alu_sub(a, d, false);) \
+    OP(BB, alu_sub(a, e, false);) \
+    OP(BC, alu_sub(a, h, false);) \
+    OP(BD, alu_sub(a, l, false);) \
+    OP(BE, alu_sub(a, read8(hl), false);) \
+    OP(BF, alu_sub(a, a, false);) \
+    OP(C0, op_ret(Condition::NZ);) \
+    OP(C1, bc = pop();) \
+    OP(C2, op_jump(Condition::NZ, fetch16());) \
+    OP(C3, op_jump(Condition::None, fetch16());) \
+    OP(C4, op_call(Condition::NZ, fetch16());) \
+    OP(C5, clock(); push(bc);) \
+    OP(C6, a = alu_add(a, fetch8(), false);) \
+    OP(C7, op_rst(0x00);) \
+    OP(C8, op_ret(Condition::Z);) \
+    OP(C9, op_ret(Condition::None);) \
+    OP(CA, op_jump(Condition::Z, fetch16());) \
+    OP(CB, op_cb();) \
+    OP(CC, op_call(Condition::Z, fetch16());) \
+    OP(CD, op_call(Condition::None, fetch16());) \
+    OP(CE, a = alu_add(a, fetch8(), true);) \
+    OP(CF, op_rst(0x08);) \
+    OP(D0, op_ret(Condition::NZ);) \
+    OP(D1, de = pop();) \
+    OP(D2, op_jump(Condition::NC, fetch16());) \
+    OP(D3, op_unknown(0xD3);) \
+    OP(D4, op_call(Condition::NC, fetch16());) \
+    OP(D5, clock(); push(de);) \
+    OP(D6, a = alu_sub(a, fetch8(), false);) \
+    OP(D7, op_rst(0x10);) \
+    OP(D8, op_ret(Condition::C);) \
+    OP(D9, ime = true; pc = pop(); clock();) \
+    OP(DA, op_jump(Condition::C, fetch16());) \
+    OP(DB, op_unknown(0xDB);) \
+    OP(DC, op_call(Condition::C, fetch16());) \
+    OP(DD, op_unknown(0xDD);) \
+    OP(DE, a = alu_sub(a, fetch8(), true);) \
+    OP(DF, op_rst(0x18);) \
+    OP(E0, write8(0xFF00 + fetch8(), a);) \
+    OP(E1, hl = pop();) \
+    OP(E2, write8(0xFF00 + c, a);) \
+    OP(E3, op_unknown(0xE3);) \
+    OP(E4, op_unknown(0xE4);) \
+    OP(E5, clock(); push(hl);) \
+    OP(E6, a = alu_and(a, fetch8());) \
+    OP(E7, op_rst(0x20);) \
+    OP(E8, sp += (i8) fetch8();) \
+    OP(E9, pc = hl;) \
+    OP(EA, write8(fetch16(), a);) \
+    OP(EB, op_unknown(0xEB);) \
+    OP(EC, op_unknown(0xEC);) \
+    OP(ED, op_unknown(0xED);) \
+    OP(EE, a = alu_xor(a, fetch8());) \
+    OP(EF, op_rst(0x28);) \
+    OP(F0, a = read8(0xFF00 + fetch8());) \
+    OP(F1, set_af(pop());) \
+    OP(F2, a = read8(0xFF00 + c);) \
+    OP(F3, ime = false; ei_pending = false;) \
+    OP(F4, op_unknown(0xF4);) \
+    OP(F5, clock(); push(af());) \
+    OP(F6, a = alu_or(a, fetch8());) \
+    OP(F7, op_rst(0x30);) \
+    OP(F8, hl = sp + (i8) fetch8();) \
+    OP(F9, sp = hl;) \
+    OP(FA, a = read8(fetch16());) \
+    OP(FB, op_ei();) \
+    OP(FC, op_unknown(0xFC);) \
+    OP(FD, op_unknown(0xFD);) \
+    OP(FE, alu_sub(a, fetch8(), false);) \
+    OP(FF, op_rst(0x38);)
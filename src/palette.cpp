@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+#include "palette.h"
+
+namespace gb {
+
+Palette::Palette() {
+    set_scheme(grey);
+}
+
+bool Palette::load_scheme(std::string_view file) {
+    std::ifstream ifs{std::string(file)};
+    if(!ifs) {
+        fmt::print("Unable to open palette {}\n", file);
+        return false;
+    }
+
+    std::vector<std::uint32_t> colors;
+    std::string line;
+    while(std::getline(ifs, line)) {
+        line = line.substr(0, line.find('#'));
+
+        std::size_t pos = 0;
+        while((pos = line.find_first_not_of(" \t\r", pos)) != std::string::npos) {
+            std::size_t end = line.find_first_of(" \t\r", pos);
+            std::string word = line.substr(pos, end - pos);
+            pos = end;
+
+            char *rest = nullptr;
+            std::uint32_t color = std::strtoul(word.c_str(), &rest, 16);
+            if(word.size() != 6 || *rest) {
+                fmt::print("Bad colour {} in palette {}\n", word, file);
+                return false;
+            }
+            colors.push_back(0xFF000000 | color);
+        }
+    }
+
+    Scheme loaded;
+    if(colors.size() == 4) {
+        for(std::size_t i = 0; i < loaded.size(); i++) {
+            loaded[i] = colors[i % 4];
+        }
+    } else if(colors.size() == 12) {
+        std::copy(colors.begin(), colors.end(), loaded.begin());
+    } else {
+        fmt::print("Palette {} has {} colours, expected 4 or 12\n", file, colors.size());
+        return false;
+    }
+
+    set_scheme(loaded);
+    return true;
+}
+
+void Palette::set_scheme(const Scheme& colors) {
+    scheme = colors;
+    resolved.set(LinePalette::blank, scheme[0]);
+    for(u8 index = 0; index < registers.size(); index++) {
+        resolve(index);
+    }
+}
+
+void Palette::write(u8 index, u8 value) {
+    registers[index] = value;
+    resolve(index);
+}
+
+void Palette::resolve(u8 index) {
+    // LinePalette keeps the background at 0-3 and sprite palettes from 4 on
+    for(u8 color = 0; color < 4; color++) {
+        u8 shade = (registers[index] >> color * 2) & 0x03;
+        resolved.set(index * 4 + color, scheme[index * 4 + shade]);
+    }
+}
+
+}
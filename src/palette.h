@@ -0,0 +1,48 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include "types.h"
+#include "compositor.h"
+
+namespace gb {
+
+// BGP, OBP0 and OBP1 resolved to output colours. MMU rebuilds the table
+// when one of the registers is written, so the renderer only ever reads a
+// ready LinePalette.
+class Palette {
+public:
+    // Output colours (ARGB) for shades 0-3 of the background, then of
+    // OBP0 and OBP1 sprites
+    using Scheme = std::array<std::uint32_t, 12>;
+
+    static constexpr Scheme grey = {
+        0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+        0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+        0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000
+    };
+
+    Palette();
+
+    // Reads a scheme as hex RRGGBB colours separated by whitespace, '#'
+    // starts a comment. 4 colours are used for every palette, 12 give the
+    // background, OBP0 and OBP1 their own
+    bool load_scheme(std::string_view file);
+    void set_scheme(const Scheme& colors);
+
+    // BGP, OBP0 or OBP1 (0-2) was written
+    void write(u8 index, u8 value);
+
+    const LinePalette& line() const {
+        return resolved;
+    }
+
+private:
+    void resolve(u8 index);
+
+    Scheme scheme = grey;
+    std::array<u8, 3> registers = {};
+    LinePalette resolved;
+};
+
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fmt/format.h>
+#include "profiler.h"
+
+namespace gb {
+
+namespace {
+
+const char *interrupt_names[] = { "vblank", "stat", "timer", "serial", "joypad" };
+
+// Rows printed per table, GB_PROFILE_TOP overrides it
+std::size_t top_count() {
+    const char *env = std::getenv("GB_PROFILE_TOP");
+    return env ? std::strtoul(env, nullptr, 10) : 20;
+}
+
+}
+
+ExecutionProfiler::ExecutionProfiler() {
+    // Root, everything outside any CALL
+    nodes.push_back({ 0, 0 });
+}
+
+ExecutionProfiler::~ExecutionProfiler() {
+    std::size_t top = top_count();
+
+    std::uint64_t total = 0;
+    for(const Count& count : opcodes) {
+        total += count.cycles;
+    }
+    if(!total) {
+        return;
+    }
+
+    // Opcodes, with the CB prefixed ones as CB xx
+    std::vector<std::pair<u16, Count>> ops;
+    for(int op = 0; op < 256; op++) {
+        if(opcodes[op].executions && op != 0xCB) {
+            ops.push_back({ op, opcodes[op] });
+        }
+        if(cb_opcodes[op].executions) {
+            ops.push_back({ 0xCB00 | op, cb_opcodes[op] });
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.executions > rhs.second.executions;
+    });
+
+    fmt::print("{:<8} {:>14} {:>14} {:>7}\n", "Opcode", "Executions", "Cycles", "Cycles%");
+    for(std::size_t i = 0; i < std::min(top, ops.size()); i++) {
+        auto& [op, count] = ops[i];
+        std::string name = op > 0xFF ? fmt::format("CB {:02X}", op & 0xFF) : fmt::format("{:02X}", op);
+        fmt::print("{:<8} {:>14} {:>14} {:>6.2f}%\n", name, count.executions, count.cycles, 100.0 * count.cycles / total);
+    }
+
+    std::vector<std::pair<std::uint32_t, Count>> pcs(addresses.begin(), addresses.end());
+    std::sort(pcs.begin(), pcs.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.cycles > rhs.second.cycles;
+    });
+
+    fmt::print("\n{:<8} {:>14} {:>14} {:>7}\n", "Address", "Executions", "Cycles", "Cycles%");
+    for(std::size_t i = 0; i < std::min(top, pcs.size()); i++) {
+        auto& [key, count] = pcs[i];
+        fmt::print("{:02X}:{:04X}  {:>14} {:>14} {:>6.2f}%\n", key >> 16, key & 0xFFFF, count.executions, count.cycles, 100.0 * count.cycles / total);
+    }
+
+    fmt::print("\n{:<8} {:>14} {:>14} {:>7}\n", "Handler", "Executions", "Cycles", "Cycles%");
+    for(int i = 0; i < 5; i++) {
+        fmt::print("{:<8} {:>14} {:>14} {:>6.2f}%\n", interrupt_names[i], interrupts[i].executions, interrupts[i].cycles, 100.0 * interrupts[i].cycles / total);
+    }
+
+    std::FILE *file = std::fopen("profile_pc.csv", "w");
+    if(file) {
+        fmt::print(file, "bank,pc,executions,cycles\n");
+        for(auto& [key, count] : pcs) {
+            fmt::print(file, "{:02X},{:04X},{},{}\n", key >> 16, key & 0xFFFF, count.executions, count.cycles);
+        }
+        std::fclose(file);
+    } else {
+        fmt::print("Unable to write profile_pc.csv\n");
+    }
+
+    file = std::fopen("profile.folded", "w");
+    if(!file) {
+        fmt::print("Unable to write profile.folded\n");
+        return;
+    }
+
+    std::vector<std::string> names(nodes.size());
+    names[0] = "main";
+    // Children are always created after their parent
+    for(std::size_t i = 1; i < nodes.size(); i++) {
+        std::uint32_t key = nodes[i].key;
+        std::string frame = (key & interrupt_key) == interrupt_key
+            ? fmt::format("int_{}", interrupt_names[((key & 0xFF) - 0x40) / 8])
+            : fmt::format("{:02X}:{:04X}", key >> 16, key & 0xFFFF);
+        names[i] = names[nodes[i].parent] + ";" + frame;
+    }
+    for(std::size_t i = 0; i < nodes.size(); i++) {
+        if(nodes[i].cycles) {
+            fmt::print(file, "{} {}\n", names[i], nodes[i].cycles);
+        }
+    }
+    std::fclose(file);
+}
+
+void ExecutionProfiler::instruction(u16 bank, u16 pc, u8 op, u8 cb, std::uint32_t cycles) {
+    Count& count = addresses[std::uint32_t(bank) << 16 | pc];
+    count.executions++;
+    count.cycles += cycles;
+
+    opcodes[op].executions++;
+    opcodes[op].cycles += cycles;
+    if(op == 0xCB) {
+        cb_opcodes[cb].executions++;
+        cb_opcodes[cb].cycles += cycles;
+    }
+
+    nodes[current].cycles += cycles;
+}
+
+void ExecutionProfiler::interrupt(u16 vector, std::uint32_t cycles, std::uint64_t now) {
+    int index = (vector - 0x40) / 8;
+    interrupts[index].executions++;
+
+    push(interrupt_key | vector, now - cycles, index);
+    nodes[current].cycles += cycles;
+}
+
+void ExecutionProfiler::call(u16 bank, u16 addr, std::uint64_t now) {
+    push(std::uint32_t(bank) << 16 | addr, now, -1);
+}
+
+void ExecutionProfiler::ret(std::uint64_t now) {
+    if(stack.empty()) {
+        // Returned past where profiling started
+        return;
+    }
+
+    if(stack.size() > max_depth) {
+        // Wasn't given a node, see push
+        stack.pop_back();
+        return;
+    }
+
+    Frame frame = stack.back();
+    stack.pop_back();
+    if(frame.vector >= 0) {
+        interrupts[frame.vector].cycles += now - frame.start;
+    }
+    current = nodes[frame.node].parent;
+}
+
+void ExecutionProfiler::push(std::uint32_t key, std::uint64_t now, int vector) {
+    if(stack.size() >= max_depth) {
+        // Code that calls without ever returning, keep counting at this depth
+        stack.push_back({ current, now, -1 });
+        return;
+    }
+
+    auto child = nodes[current].children.find(key);
+    std::size_t node;
+    if(child != nodes[current].children.end()) {
+        node = child->second;
+    } else {
+        node = nodes.size();
+        nodes[current].children[key] = node;
+        nodes.push_back({ current, key });
+    }
+
+    current = node;
+    stack.push_back({ current, now, vector });
+}
+
+}
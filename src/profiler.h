@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "types.h"
+
+namespace gb {
+
+// Execution profiling for CPU::run/step. Like MemoryPolicy it's picked at
+// compile time (GB_PROFILER in CMakeLists.txt), with the profiler compiled in
+// every instruction is interpreted so it can be seen.
+
+class NullProfiler {
+public:
+    static constexpr bool enabled = false;
+
+    void instruction(u16, u16, u8, u8, std::uint32_t) { }
+    void interrupt(u16, std::uint32_t, std::uint64_t) { }
+    void call(u16, u16, std::uint64_t) { }
+    void ret(std::uint64_t) { }
+};
+
+class ExecutionProfiler {
+public:
+    static constexpr bool enabled = true;
+
+    ExecutionProfiler();
+    // Prints the top opcodes, addresses and interrupt handlers and writes
+    // profile.folded (for flamegraph.pl and friends) and profile_pc.csv
+    ~ExecutionProfiler();
+
+    // An instruction at bank:pc finished after taking cycles. cb is the
+    // second byte of CB prefixed opcodes
+    void instruction(u16 bank, u16 pc, u8 op, u8 cb, std::uint32_t cycles);
+
+    // Interrupt entry to vector took cycles, now is the counter afterwards
+    void interrupt(u16 vector, std::uint32_t cycles, std::uint64_t now);
+
+    // A CALL/RST was taken to bank:addr, or a RET/RETI returned
+    void call(u16 bank, u16 addr, std::uint64_t now);
+    void ret(std::uint64_t now);
+
+private:
+    struct Count {
+        std::uint64_t executions = 0;
+        std::uint64_t cycles = 0;
+    };
+
+    // Call tree, cycles are attributed to the node that was running
+    struct Node {
+        std::size_t parent;
+        std::uint32_t key; // bank << 16 | addr, see interrupt_key
+        std::uint64_t cycles = 0;
+        std::map<std::uint32_t, std::size_t> children = {};
+    };
+
+    struct Frame {
+        std::size_t node;
+        std::uint64_t start;
+        int vector; // Interrupt handler index or -1
+    };
+
+    // Interrupt frames use keys no CALL can produce
+    static constexpr std::uint32_t interrupt_key = 0xFFFF0000;
+    static constexpr std::size_t max_depth = 256;
+
+    void push(std::uint32_t key, std::uint64_t now, int vector);
+
+    std::unordered_map<std::uint32_t, Count> addresses;
+    std::array<Count, 256> opcodes;
+    std::array<Count, 256> cb_opcodes;
+    std::array<Count, 5> interrupts;
+
+    std::vector<Node> nodes;
+    std::vector<Frame> stack;
+    std::size_t current = 0;
+};
+
+#if defined(GB_PROFILER)
+using Profiler = ExecutionProfiler;
+#else
+using Profiler = NullProfiler;
+#endif
+
+}
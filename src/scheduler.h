@@ -0,0 +1,89 @@
+#pragma once
+#include <array>
+#include <limits>
+#include "types.h"
+
+namespace gb {
+
+enum class Event : u8 {
+    LCD, // LCD mode finished, see LCD::advance
+    Timer, // TIMA overflowed
+    DMA, // OAM DMA finished
+    Serial, // Serial transfer finished
+    Count
+};
+
+// Keeps one timestamp per event type. The CPU compares the cycle counter
+// against next and only services events once one is due, everything else
+// runs in between without being ticked.
+class Scheduler {
+public:
+    static constexpr std::uint64_t never = std::numeric_limits<std::uint64_t>::max();
+
+    Scheduler() {
+        times.fill(never);
+    }
+
+    void schedule(Event event, std::uint64_t when) {
+        std::uint64_t& time = times[static_cast<u8>(event)];
+        // Moving the earliest event later means another may be next now
+        bool was_next = time == next;
+        time = when;
+        if(was_next || when > next) {
+            update_next();
+        } else {
+            next = when;
+        }
+    }
+
+    void schedule_in(Event event, std::uint64_t delay) {
+        schedule(event, cycles + delay);
+    }
+
+    void cancel(Event event) {
+        times[static_cast<u8>(event)] = never;
+        update_next();
+    }
+
+    bool scheduled(Event event) const {
+        return times[static_cast<u8>(event)] != never;
+    }
+
+    // Pops the earliest event that is due, returns false once none are
+    bool pop(Event& event, std::uint64_t& when) {
+        if(next > cycles) {
+            return false;
+        }
+
+        for(u8 i = 0; i < times.size(); i++) {
+            if(times[i] == next) {
+                event = static_cast<Event>(i);
+                when = next;
+                times[i] = never;
+                update_next();
+                return true;
+            }
+        }
+
+        // next was stale, nothing is actually due
+        update_next();
+        return false;
+    }
+
+    std::uint64_t cycles = 0;
+    std::uint64_t next = never;
+
+private:
+    void update_next() {
+        next = never;
+        for(std::uint64_t time : times) {
+            if(time < next) {
+                next = time;
+            }
+        }
+    }
+
+    std::array<std::uint64_t, static_cast<u8>(Event::Count)> times;
+};
+
+}
@@ -0,0 +1,34 @@
+#include <cstring>
+#include "tiles.h"
+
+namespace gb {
+
+namespace {
+
+// Bit 7 - x of a bitplane byte moved to the bottom of byte x
+constexpr std::array<std::uint64_t, 256> make_spread() {
+    std::array<std::uint64_t, 256> spread = {};
+    for(int value = 0; value < 256; value++) {
+        for(int x = 0; x < 8; x++) {
+            if(value & (0x80 >> x)) {
+                spread[value] |= std::uint64_t(1) << (x * 8);
+            }
+        }
+    }
+    return spread;
+}
+
+constexpr std::array<std::uint64_t, 256> spread = make_spread();
+
+}
+
+void TileCache::write(u16 offset, u8 low, u8 high) {
+    std::uint64_t pixels = spread[low] | spread[high] << 1;
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    pixels = __builtin_bswap64(pixels);
+#endif
+    std::memcpy(rows[offset / 2].data(), &pixels, sizeof(pixels));
+    versions[offset / 16]++;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <array>
+#include "types.h"
+
+namespace gb {
+
+// The 384 tiles at 0x8000-0x97FF decoded to one colour index (0-3) per
+// byte. MMU keeps it up to date on every write to tile data, so the GPU
+// reads ready made rows of 8 pixels instead of picking bits out of the
+// bitplanes for every pixel.
+class TileCache {
+public:
+    static constexpr u16 count = 384;
+
+    // Bitplane bytes at offset & ~1 and offset | 1 from 0x8000 changed
+    void write(u16 offset, u8 low, u8 high);
+
+    // Row y (0-7) of tile index, indexes are 0x8000 based
+    const u8 *row(u16 index, u8 y) const {
+        return rows[index * 8 + y].data();
+    }
+
+    // Changes every time the tile is written
+    std::uint32_t version(u16 index) const {
+        return versions[index];
+    }
+
+private:
+    std::array<std::array<u8, 8>, count * 8> rows = {};
+    std::array<std::uint32_t, count> versions = {};
+};
+
+}
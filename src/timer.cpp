@@ -0,0 +1,98 @@
+#include "timer.h"
+#include "mmu.h"
+
+namespace gb {
+
+Timer::Timer(Scheduler& scheduler, IO& io) : scheduler(scheduler), io(io) {
+
+}
+
+u8 Timer::read_div() const {
+    return (scheduler.cycles - div_base) >> 8;
+}
+
+u8 Timer::read_tima() {
+    sync(scheduler.cycles);
+    return tima;
+}
+
+void Timer::write_div() {
+    std::uint64_t now = scheduler.cycles;
+    sync(now);
+
+    // Resetting the divider while the selected bit is high is a falling edge
+    if(signal(now)) {
+        increment();
+    }
+
+    div_base = now;
+    reschedule();
+}
+
+void Timer::write_tima(u8 value) {
+    sync(scheduler.cycles);
+    tima = value;
+    reschedule();
+}
+
+void Timer::write_tac(u8 value) {
+    std::uint64_t now = scheduler.cycles;
+    sync(now);
+
+    bool before = signal(now);
+    io.TAC = 0b1111'1000 | value;
+
+    // Disabling the timer or switching to a low bit can also cause an edge
+    if(before && !signal(now)) {
+        increment();
+    }
+
+    reschedule();
+}
+
+void Timer::overflow(std::uint64_t when) {
+    tima = io.TMA;
+    tima_time = when;
+    io.IF |= 0b0000'0100;
+    reschedule();
+}
+
+bool Timer::enabled() const {
+    return io.TAC & 0b100;
+}
+
+u8 Timer::shift() const {
+    static const u8 shifts[] = { 10, 4, 6, 8 };
+    return shifts[io.TAC & 0b11];
+}
+
+bool Timer::signal(std::uint64_t now) const {
+    return enabled() && ((now - div_base) >> (shift() - 1) & 1);
+}
+
+void Timer::sync(std::uint64_t now) {
+    if(enabled()) {
+        // The overflow event fires before this can pass 255
+        tima += ((now - div_base) >> shift()) - ((tima_time - div_base) >> shift());
+    }
+    tima_time = now;
+}
+
+void Timer::increment() {
+    if(++tima == 0) {
+        tima = io.TMA;
+        io.IF |= 0b0000'0100;
+    }
+}
+
+void Timer::reschedule() {
+    if(!enabled()) {
+        scheduler.cancel(Event::Timer);
+        return;
+    }
+
+    std::uint64_t edge = ((tima_time - div_base) >> shift()) + (256 - tima);
+    scheduler.schedule(Event::Timer, div_base + (edge << shift()));
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "types.h"
+#include "scheduler.h"
+
+namespace gb {
+
+struct IO;
+
+// DIV/TIMA are worked out from the cycle counter when read instead of
+// being ticked. The 16 bit divider is the number of cycles since it was
+// last reset, TIMA counts the falling edges of the divider bit picked by
+// TAC and the only thing that's scheduled is the next overflow.
+class Timer {
+public:
+    Timer(Scheduler& scheduler, IO& io);
+
+    u8 read_div() const;
+    u8 read_tima();
+
+    void write_div();
+    void write_tima(u8 value);
+    void write_tac(u8 value);
+
+    // Event::Timer, TIMA wrapped so reload it from TMA and raise IF bit 2
+    void overflow(std::uint64_t when);
+
+private:
+    bool enabled() const;
+    // log2 of the TIMA period in cycles
+    u8 shift() const;
+    // State of the divider bit feeding TIMA
+    bool signal(std::uint64_t now) const;
+
+    void sync(std::uint64_t now);
+    void increment();
+    void reschedule();
+
+    Scheduler& scheduler;
+    IO& io;
+
+    std::uint64_t div_base = 0; // Cycle the divider was last reset at
+    std::uint64_t tima_time = 0; // Cycle tima was last brought up to date
+    u8 tima = 0;
+};
+
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <string>
+#include <fmt/format.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+
+namespace gb {
+
+namespace {
+
+// The tracer the crash handler saves
+RingTracer *crash_tracer = nullptr;
+
+std::uint32_t env_address(const char *name, std::uint32_t fallback) {
+    const char *env = std::getenv(name);
+    return env ? std::strtoul(env, nullptr, 16) & 0xFFFF : fallback;
+}
+
+bool write_all(int fd, const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while(size) {
+        ssize_t written = ::write(fd, bytes, size);
+        if(written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+}
+
+RingTracer::RingTracer() {
+    std::uint64_t size = 1 << 20;
+    if(const char *env = std::getenv("GB_TRACE_SIZE")) {
+        size = std::max<std::uint64_t>(std::strtoull(env, nullptr, 10), 1);
+    }
+    // Power of two so a slot is just head & mask
+    std::uint64_t capacity = 1;
+    while(capacity < size) {
+        capacity <<= 1;
+    }
+    ring = std::make_unique<TraceRecord[]>(capacity);
+    mask = capacity - 1;
+
+    if(const char *env = std::getenv("GB_TRACE_FILE")) {
+        path = env;
+    }
+
+    trigger_pc = env_address("GB_TRACE_PC", no_trigger);
+    trigger_write = env_address("GB_TRACE_WRITE", no_trigger);
+    stop_on_trigger = std::getenv("GB_TRACE_STOP") != nullptr;
+    // Without a start trigger everything is recorded
+    recording = stop_on_trigger || (trigger_pc == no_trigger && trigger_write == no_trigger);
+
+    if(const char *env = std::getenv("GB_TRACE_CYCLES")) {
+        char *end = nullptr;
+        from = std::strtoull(env, &end, 10);
+        if(*end == '-') {
+            to = std::strtoull(end + 1, nullptr, 10);
+        }
+    }
+
+    crash_tracer = this;
+    std::signal(SIGSEGV, on_crash);
+    std::signal(SIGABRT, on_crash);
+}
+
+RingTracer::~RingTracer() {
+    if(crash_tracer == this) {
+        crash_tracer = nullptr;
+    }
+    if(!save()) {
+        fmt::print("Unable to write {}\n", path);
+    }
+}
+
+bool RingTracer::save() const {
+    std::uint64_t end = head.load(std::memory_order_acquire);
+    if(!end) {
+        return true;
+    }
+
+    TraceHeader header;
+    header.count = std::min(end, mask + 1);
+    header.dropped = end - header.count;
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+
+    // Oldest record to the end of the ring, then the wrapped part
+    std::uint64_t start = header.dropped & mask;
+    std::uint64_t first = std::min(header.count, mask + 1 - start);
+    bool ok = write_all(fd, &header, sizeof(header))
+        && write_all(fd, &ring[start], first * sizeof(TraceRecord))
+        && write_all(fd, &ring[0], (header.count - first) * sizeof(TraceRecord));
+
+    return ::close(fd) == 0 && ok;
+}
+
+void RingTracer::on_crash(int signal) {
+    if(crash_tracer) {
+        crash_tracer->save();
+    }
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+}
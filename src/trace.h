@@ -0,0 +1,127 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "types.h"
+
+namespace gb {
+
+// Binary execution trace, the compact replacement for calling dump_std()
+// every step. Like Profiler it's picked at compile time (GB_TRACE in
+// CMakeLists.txt). tools/trace_decode.cpp turns a saved trace back into
+// dump_std text.
+
+// CPU state before an instruction, what dump_std prints
+struct TraceRecord {
+    std::uint32_t cycles; // Low 32 bits of CPU::cycles
+    u16 pc;
+    u16 sp;
+    u8 a, f, b, c, d, e, h, l;
+    std::array<u8, 4> bytes; // Memory at pc
+};
+
+static_assert(sizeof(TraceRecord) == 20, "trace files are read back as raw records");
+
+// Start of a trace file, followed by count records, oldest first
+struct TraceHeader {
+    static constexpr std::array<char, 4> gbtr = { 'G', 'B', 'T', 'R' };
+    static constexpr std::uint32_t current_version = 1;
+
+    std::array<char, 4> magic = gbtr;
+    std::uint32_t version = current_version;
+    std::uint32_t record_size = sizeof(TraceRecord);
+    std::uint32_t reserved = 0;
+    std::uint64_t count = 0;
+    std::uint64_t dropped = 0; // Records overwritten before the first one
+};
+
+class NullTracer {
+public:
+    static constexpr bool enabled = false;
+
+    bool wants(u16, std::uint64_t) { return false; }
+    void write(u16) { }
+    void record(const TraceRecord&) { }
+    bool save() const { return true; }
+};
+
+// Keeps the last GB_TRACE_SIZE records (default 1M) and writes them to
+// GB_TRACE_FILE (default trace.bin) on exit, on an unknown opcode and on
+// SIGSEGV/SIGABRT.
+//
+// Triggers, all optional:
+//   GB_TRACE_PC=0150      recording starts when pc reaches 0150
+//   GB_TRACE_WRITE=C000   recording starts after a write to C000
+//   GB_TRACE_STOP=1       the PC/write triggers freeze the buffer instead
+//   GB_TRACE_CYCLES=a-b   only cycles in [a, b) are recorded
+class RingTracer {
+public:
+    static constexpr bool enabled = true;
+
+    RingTracer();
+    ~RingTracer();
+
+    RingTracer(const RingTracer&) = delete;
+    RingTracer& operator=(const RingTracer&) = delete;
+
+    // Whether the instruction about to run at pc should be recorded
+    bool wants(u16 pc, std::uint64_t cycles) {
+        if(pc == trigger_pc) {
+            trigger();
+        }
+        return recording && cycles >= from && cycles < to;
+    }
+
+    void write(u16 addr) {
+        if(addr == trigger_write) {
+            trigger();
+        }
+    }
+
+    // Single producer, readers only look at slots below head
+    void record(const TraceRecord& record) {
+        std::uint64_t slot = head.load(std::memory_order_relaxed);
+        ring[slot & mask] = record;
+        head.store(slot + 1, std::memory_order_release);
+    }
+
+    // Only uses async signal safe calls so the crash handler can call it
+    bool save() const;
+
+private:
+    // Out of range of any address, for triggers that aren't set
+    static constexpr std::uint32_t no_trigger = 0x10000;
+
+    void trigger() {
+        if(!triggered) {
+            triggered = true;
+            recording = !stop_on_trigger;
+        }
+    }
+
+    static void on_crash(int signal);
+
+    std::unique_ptr<TraceRecord[]> ring;
+    std::uint64_t mask = 0;
+    std::atomic<std::uint64_t> head = 0;
+
+    std::uint32_t trigger_pc = no_trigger;
+    std::uint32_t trigger_write = no_trigger;
+    bool stop_on_trigger = false;
+    bool triggered = false;
+    bool recording = true;
+    std::uint64_t from = 0;
+    std::uint64_t to = ~std::uint64_t(0);
+
+    std::string path = "trace.bin";
+};
+
+#if defined(GB_TRACE)
+using Tracer = RingTracer;
+#else
+using Tracer = NullTracer;
+#endif
+
+}
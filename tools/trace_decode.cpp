@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+#include "trace.h"
+
+// Prints a trace written by RingTracer in the same format as CPU::dump_std,
+// so it can be diffed against other emulators' logs.
+//
+// gb_trace [--cycles] [trace.bin]
+//
+// --cycles prefixes every line with the cycle counter, counted from the low
+// 32 bits stored in the records so it's only exact relative to each other.
+
+int main(int argc, char *argv[]) {
+    bool cycles = false;
+    std::string path = "trace.bin";
+    for(int i = 1; i < argc; i++) {
+        if(std::strcmp(argv[i], "--cycles") == 0) {
+            cycles = true;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    std::ifstream ifs{path, std::ios::binary};
+    if(!ifs) {
+        fmt::print(stderr, "Unable to open {}\n", path);
+        return 1;
+    }
+
+    gb::TraceHeader header;
+    ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if(!ifs || header.magic != gb::TraceHeader::gbtr) {
+        fmt::print(stderr, "{} is not a trace\n", path);
+        return 1;
+    }
+    if(header.version != gb::TraceHeader::current_version || header.record_size != sizeof(gb::TraceRecord)) {
+        fmt::print(stderr, "{} is trace version {} with {} byte records, expected version {} with {}\n",
+            path, header.version, header.record_size, gb::TraceHeader::current_version, sizeof(gb::TraceRecord));
+        return 1;
+    }
+
+    if(header.dropped) {
+        fmt::print(stderr, "{} older records were overwritten\n", header.dropped);
+    }
+
+    std::vector<gb::TraceRecord> records(4096);
+    std::uint64_t left = header.count;
+    std::uint64_t high = 0;
+    std::uint32_t last = 0;
+    fmt::memory_buffer out;
+
+    while(left) {
+        std::size_t n = std::min<std::uint64_t>(left, records.size());
+        ifs.read(reinterpret_cast<char *>(records.data()), n * sizeof(gb::TraceRecord));
+        if(!ifs) {
+            fmt::print(stderr, "{} is truncated, {} records missing\n", path, left);
+            return 1;
+        }
+        left -= n;
+
+        out.clear();
+        for(std::size_t i = 0; i < n; i++) {
+            const gb::TraceRecord& r = records[i];
+            if(cycles) {
+                // The counter only goes up, a smaller value means it wrapped
+                if(r.cycles < last) {
+                    high += std::uint64_t(1) << 32;
+                }
+                last = r.cycles;
+                fmt::format_to(std::back_inserter(out), "{:>12} ", high | r.cycles);
+            }
+            fmt::format_to(std::back_inserter(out), "A: {:02X} F: {:02X} B: {:02X} C: {:02X} D: {:02X} E: {:02X} H: {:02X} L: {:02X} SP: {:04X} PC: 00:{:04X} ({:02X} {:02X} {:02X} {:02X})\n",
+                r.a,
+                r.f,
+                r.b,
+                r.c,
+                r.d,
+                r.e,
+                r.h,
+                r.l,
+                r.sp,
+                r.pc,
+                r.bytes[0],
+                r.bytes[1],
+                r.bytes[2],
+                r.bytes[3]);
+        }
+        std::fwrite(out.data(), 1, out.size(), stdout);
+    }
+
+    return 0;
+}